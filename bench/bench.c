@@ -0,0 +1,574 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Host side benchmarks, no debugger needed. Every case runs for a while
+ * and the results are printed as a JSON object on stdout:
+ * operations, payload bytes, time per operation and throughput.
+ * A failing case is reported as such and ends the object early, which
+ * stays valid JSON.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "ccd.h"
+#include "crc.h"
+#include "hex.h"
+#include "target.h"
+#include "usb_backend.h"
+
+enum {
+	bench_min_ns       = 200000000,
+	bench_image_size   = 224 * 1024,
+	bench_small_size   = 8 * 1024,
+	bench_max_record   = 32,
+};
+
+typedef err_t (*bench_fn_t)(void *arg);
+
+typedef struct {
+	uint8_t *data;
+	int size;
+	char *hex;
+	size_t hex_size;
+	char *hex_full;
+	size_t hex_full_size;
+	char *hex_mixed;
+	size_t hex_mixed_size;
+	hex_image_t image;
+	ccd_ctx_t *ctx;
+	uint64_t usb_bytes;
+} bench_t;
+
+static int bench_count;
+
+/*
+ * The benchmark links every module but main and the libusb transport,
+ * there is no hardware to talk to.
+ */
+int usb_libusb_count(int vendor_id, int product_id)
+{
+	(void)vendor_id;
+	(void)product_id;
+	return 0;
+}
+
+void *usb_libusb_open(int vendor_id, int product_id, int index, const usb_transport_t **transport)
+{
+	(void)vendor_id;
+	(void)product_id;
+	(void)index;
+	(void)transport;
+	fprintf(stderr, "Built without libusb\n");
+	return NULL;
+}
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static err_t bench_run(bench_t *bench, const char *name, bench_fn_t fn, int bytes)
+{
+	err_t err = err_failed;
+	uint64_t start_ns = bench_now_ns();
+	uint64_t elapsed_ns;
+	uint64_t ops = 0;
+
+	bench->usb_bytes = 0;
+
+	do {
+		err = fn(bench);
+		noerr_or_out(err);
+		ops++;
+		elapsed_ns = bench_now_ns() - start_ns;
+	} while (elapsed_ns < bench_min_ns);
+
+	printf("%s  \"%s\": {\"ops\": %llu, \"bytes\": %llu, \"ns_per_op\": %.1f, \"mb_per_s\": %.2f",
+		bench_count++ ? ",\n" : "",
+		name,
+		(unsigned long long)ops,
+		(unsigned long long)ops * bytes,
+		(double)elapsed_ns / ops,
+		(double)ops * bytes * 1000 / elapsed_ns);
+	if (bench->usb_bytes) {
+		printf(", \"usb_bytes_per_byte\": %.2f", (double)bench->usb_bytes / (ops * bytes));
+	}
+	printf("}");
+	fflush(stdout);
+
+out:
+	if (err) {
+		printf("%s  \"%s\": {\"failed\": true}", bench_count++ ? ",\n" : "", name);
+		fprintf(stderr, "Benchmark %s failed\n", name);
+	}
+	return err;
+}
+
+/*
+ * Transport that swallows commands and answers reads with zeros: every
+ * poll is done at once, only the cost of building the commands is left.
+ */
+static err_t null_control(
+	void *backend, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	(void)backend;
+	(void)request;
+	(void)value;
+	(void)index;
+
+	if (endpoint == USB_IN) {
+		memset(data, 0, size);
+	}
+
+	return err_none;
+}
+
+static err_t null_submit(
+	void *backend, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	bench_t *bench = backend;
+
+	if (endpoint == USB_IN) {
+		memset(data, 0, size);
+	}
+	else {
+		bench->usb_bytes += size;
+	}
+	if (callback) {
+		callback(user, err_none);
+	}
+
+	return err_none;
+}
+
+static err_t null_flush(void *backend)
+{
+	(void)backend;
+	return err_none;
+}
+
+static void null_close(void *backend)
+{
+	(void)backend;
+}
+
+static const usb_transport_t null_transport = {
+	.control = null_control,
+	.submit  = null_submit,
+	.flush   = null_flush,
+	.close   = null_close,
+};
+
+static uint32_t bench_random(uint32_t *state)
+{
+	// xorshift32
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static int hex_record(char *out, int type, uint16_t addr, const uint8_t *data, int size)
+{
+	uint8_t sum = size + (addr >> 8) + (addr & 0xff) + type;
+	int len;
+
+	len = sprintf(out, ":%02X%04X%02X", size, addr, type);
+	for (int i = 0; i < size; i++) {
+		len += sprintf(out + len, "%02X", data[i]);
+		sum += data[i];
+	}
+	len += sprintf(out + len, "%02X\r\n", (uint8_t)-sum);
+
+	return len;
+}
+
+/*
+ * HEX text for data, in records of record_size bytes, or of 1 to
+ * bench_max_record bytes in turn if record_size is 0. Erased records are
+ * left out, as linkers do. The text is allocated.
+ */
+static char *bench_hex_text(const uint8_t *data, int size, int record_size, size_t *text_size)
+{
+	// A record takes 13 characters and 2 per byte, a base record 17
+	char *text = malloc((size_t)size * (2 + 13) + (size / 0x10000 + 1) * 17 + 16);
+	size_t len = 0;
+	int records = 0;
+
+	if (!text) {
+		return NULL;
+	}
+
+	for (int addr = 0; addr < size; records++) {
+		int n = record_size ? record_size : records % bench_max_record + 1;
+		int erased = 1;
+
+		// Records don't cross a 64 KB base
+		n = n < size - addr ? n : size - addr;
+		n = n < 0x10000 - (addr & 0xffff) ? n : 0x10000 - (addr & 0xffff);
+
+		if (addr % 0x10000 == 0) {
+			uint8_t base[2] = { addr >> 24, addr >> 16 };
+			len += hex_record(text + len, 4, 0, base, sizeof(base));
+		}
+
+		for (int i = 0; i < n && erased; i++) {
+			erased = data[addr + i] == 0xff;
+		}
+		if (!erased) {
+			len += hex_record(text + len, 0, addr & 0xffff, data + addr, n);
+		}
+
+		addr += n;
+	}
+	len += hex_record(text + len, 1, 0, NULL, 0);
+
+	*text_size = len;
+
+	return text;
+}
+
+/*
+ * Random image with an erased hole every 8 KB, as linkers leave them, in
+ * 16-byte records. Also a whole flash image without holes and a small one
+ * with records of every size, to parse.
+ */
+static err_t bench_make_image(bench_t *bench)
+{
+	err_t err = err_failed;
+	uint32_t state = 0x2541;
+	uint8_t *full = NULL;
+
+	bench->size = bench_image_size;
+	bench->data = malloc(bench->size);
+	full = malloc(TARGET_FLASH_MAX_SIZE);
+	if (!bench->data || !full) {
+		error_out("Can't allocate memory\n");
+	}
+
+	for (int i = 0; i < bench->size; i++) {
+		bench->data[i] = (i % 8192) >= 7168 ? 0xff : bench_random(&state);
+	}
+	for (int i = 0; i < TARGET_FLASH_MAX_SIZE; i++) {
+		full[i] = bench_random(&state);
+	}
+
+	bench->hex = bench_hex_text(bench->data, bench->size, 16, &bench->hex_size);
+	bench->hex_full = bench_hex_text(full, TARGET_FLASH_MAX_SIZE, 16, &bench->hex_full_size);
+	bench->hex_mixed = bench_hex_text(full, bench_small_size, 0, &bench->hex_mixed_size);
+	if (!bench->hex || !bench->hex_full || !bench->hex_mixed) {
+		error_out("Can't allocate memory\n");
+	}
+
+	err = hex_parse(&bench->image, bench->hex, bench->hex_size);
+	noerr_or_out(err);
+
+out:
+	free(full);
+	return err;
+}
+
+static err_t bench_hex_parse_text(const char *text, size_t text_size)
+{
+	hex_image_t image;
+	err_t err;
+
+	err = hex_parse(&image, text, text_size);
+	hex_free(&image);
+
+	return err;
+}
+
+static err_t bench_hex_parse(void *arg)
+{
+	bench_t *bench = arg;
+
+	return bench_hex_parse_text(bench->hex, bench->hex_size);
+}
+
+static err_t bench_hex_parse_full(void *arg)
+{
+	bench_t *bench = arg;
+
+	return bench_hex_parse_text(bench->hex_full, bench->hex_full_size);
+}
+
+static err_t bench_hex_parse_mixed(void *arg)
+{
+	bench_t *bench = arg;
+
+	return bench_hex_parse_text(bench->hex_mixed, bench->hex_mixed_size);
+}
+
+static int reference_decode(const char *chars, int size)
+{
+	char *str = strndup(chars, size);
+	int val = strtol(str, NULL, 16);
+
+	free(str);
+
+	return val;
+}
+
+/*
+ * The parser as it was before hex_parse(): a getline() per record, every
+ * byte decoded with strndup() and strtol(), and the checksum decoded in a
+ * second pass. Only there to measure against, so the format checks are
+ * left out.
+ */
+static err_t bench_hex_parse_reference(void *arg)
+{
+	err_t err = err_failed;
+	bench_t *bench = arg;
+	uint8_t *buffer = NULL;
+	uint32_t base = 0;
+	char *line = NULL;
+	size_t capacity = 0;
+	FILE *fp;
+
+	fp = fmemopen(bench->hex_full, bench->hex_full_size, "r");
+	buffer = malloc(TARGET_FLASH_MAX_SIZE);
+	if (!fp || !buffer) {
+		error_out("Can't allocate memory\n");
+	}
+	memset(buffer, 0xff, TARGET_FLASH_MAX_SIZE);
+
+	while (getline(&line, &capacity, fp) > 0) {
+		int bytecount = reference_decode(line + 1, 2);
+		uint32_t address = base + reference_decode(line + 3, 4);
+		int type = reference_decode(line + 7, 2);
+		uint8_t sum = 0;
+
+		for (int i = 0; i < bytecount + 5; i++) {
+			sum += reference_decode(line + 1 + 2 * i, 2);
+		}
+		if (sum) {
+			error_out("HEX checksum doesn't match\n");
+		}
+
+		if (type == 0) {
+			for (int i = 0; i < bytecount; i++) {
+				buffer[address + i] = reference_decode(line + 9 + 2 * i, 2);
+			}
+		}
+		else if (type == 4) {
+			base = reference_decode(line + 9, 4) << 16;
+		}
+		else if (type == 1) {
+			break;
+		}
+	}
+
+	err = err_none;
+
+out:
+	if (fp) {
+		fclose(fp);
+	}
+	free(line);
+	free(buffer);
+	return err;
+}
+
+static err_t bench_crc16(void *arg)
+{
+	bench_t *bench = arg;
+	volatile uint16_t crc;
+
+	crc = compute_crc16(bench->data, bench->size, 0xffff);
+	(void)crc;
+
+	return err_none;
+}
+
+static err_t bench_log_bytes(void *arg)
+{
+	bench_t *bench = arg;
+
+	log_bytes(bench->data, bench->size);
+
+	return err_none;
+}
+
+static err_t bench_write_xdata_small(void *arg)
+{
+	bench_t *bench = arg;
+
+	return target_write_xdata(bench->ctx, 0x0000, bench->data, TARGET_BURST_MIN_SIZE - 1);
+}
+
+static err_t bench_write_xdata_burst(void *arg)
+{
+	bench_t *bench = arg;
+
+	return target_write_xdata(bench->ctx, 0x1000, bench->data, 4096);
+}
+
+static err_t bench_read_xdata(void *arg)
+{
+	bench_t *bench = arg;
+
+	return target_read_xdata(bench->ctx, 0x1000, bench->data, 4096);
+}
+
+static err_t bench_flash(void *arg)
+{
+	bench_t *bench = arg;
+	err_t err;
+
+	err = ccd_erase(bench->ctx);
+	noerr_or_out(err);
+
+	err = hex_write(bench->ctx, &bench->image, ccd_write_erased);
+	noerr_or_out(err);
+
+out:
+	return err;
+}
+
+static err_t bench_read_code(void *arg)
+{
+	bench_t *bench = arg;
+
+	return target_read_code(bench->ctx, 0, bench->data, bench->size);
+}
+
+static err_t bench_flash_unchanged(void *arg)
+{
+	bench_t *bench = arg;
+
+	return hex_write(bench->ctx, &bench->image, ccd_write_diff);
+}
+
+static ccd_ctx_t *bench_null_ctx(bench_t *bench)
+{
+	ccd_ctx_t *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
+	}
+
+	wait_model_init(&ctx->wait);
+
+	ctx->usb = usb_open_transport(bench, &null_transport);
+	if (!ctx->usb || target_command_reserve(ctx, TARGET_CMD_CAPACITY)) {
+		ccd_close(ctx);
+		ctx = NULL;
+	}
+
+out:
+	return ctx;
+}
+
+int main(void)
+{
+	err_t err = err_failed;
+	bench_t bench = { .data = NULL };
+	int started = 0;
+	ccd_config_t sim_config = { .sim_options = "write=0,erase=0,chip-erase=0,dma=0" };
+
+	log_set(log_off);
+
+	err = bench_make_image(&bench);
+	noerr_or_out(err);
+
+	printf("{\n");
+	started = 1;
+
+	err = bench_run(&bench, "hex.parse", bench_hex_parse, bench.hex_size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "hex.parse.full", bench_hex_parse_full, bench.hex_full_size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "hex.parse.mixed", bench_hex_parse_mixed, bench.hex_mixed_size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "hex.parse.reference", bench_hex_parse_reference, bench.hex_full_size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "crc16", bench_crc16, bench.size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "log_bytes.disabled", bench_log_bytes, bench.size);
+	noerr_or_out(err);
+
+	// Command encoding, against a transport that costs nothing
+	bench.ctx = bench_null_ctx(&bench);
+	if (!bench.ctx) {
+		err = err_failed;
+		goto out;
+	}
+
+	err = bench_run(&bench, "encode.write_xdata", bench_write_xdata_small, TARGET_BURST_MIN_SIZE - 1);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "encode.write_xdata.burst", bench_write_xdata_burst, 4096);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "encode.read_xdata", bench_read_xdata, 4096);
+	noerr_or_out(err);
+
+	ccd_close(bench.ctx);
+
+	// End to end, against the simulator with the flash timings left out
+	bench.ctx = ccd_open(0, &sim_config);
+	if (!bench.ctx) {
+		err = err_failed;
+		goto out;
+	}
+
+	err = ccd_enter_debug(bench.ctx, 0);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "flash.sim", bench_flash, bench.size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "flash.sim.unchanged", bench_flash_unchanged, bench.size);
+	noerr_or_out(err);
+
+	err = bench_run(&bench, "read_code.sim", bench_read_code, bench.size);
+	noerr_or_out(err);
+
+out:
+	if (started) {
+		printf("\n}\n");
+	}
+	ccd_close(bench.ctx);
+	hex_free(&bench.image);
+	free(bench.hex);
+	free(bench.hex_full);
+	free(bench.hex_mixed);
+	free(bench.data);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ccd.h"
+#include "crc.h"
+#include "hex.h"
+#include "stats.h"
+#include "target.h"
+#include "usb_backend.h"
+
+/*
+ * Holds the fast CRC16 implementations against the bitwise reference, on
+ * random lengths, alignments and seeds, the HEX parser on corner cases,
+ * and the target and flashing paths against the simulator. Exits non-zero on any mismatch.
+ */
+
+enum {
+	check_max_size = 4096,
+	check_runs     = 20000,
+};
+
+typedef struct {
+	const char *name;
+	uint16_t (*fn)(const uint8_t *data, int size, uint16_t init);
+} check_impl_t;
+
+static uint32_t check_seed = 0x2541;
+
+/*
+ * The check links every module but main and the libusb transport,
+ * the target is simulated.
+ */
+int usb_libusb_count(int vendor_id, int product_id)
+{
+	(void)vendor_id;
+	(void)product_id;
+	return 0;
+}
+
+void *usb_libusb_open(int vendor_id, int product_id, int index, const usb_transport_t **transport)
+{
+	(void)vendor_id;
+	(void)product_id;
+	(void)index;
+	(void)transport;
+	fprintf(stderr, "Built without libusb\n");
+	return NULL;
+}
+
+static uint32_t check_random(void)
+{
+	check_seed = check_seed * 1103515245 + 12345;
+	return check_seed >> 8;
+}
+
+static int check_one(const check_impl_t *impl, const uint8_t *data, int size, uint16_t init)
+{
+	uint16_t expected = crc16_bitwise(data, size, init);
+	uint16_t actual = impl->fn(data, size, init);
+
+	if (actual != expected) {
+		fprintf(stderr, "%s: %dB at offset %d, init 0x%04x: 0x%04x != 0x%04x\n",
+			impl->name, size, (int)((uintptr_t)data % 16), init, actual, expected);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_crc16(void)
+{
+	static const int sizes[] = { 0, 1, 7, 8, 15, 16, 17, 63, 64, 65, 127, 128, 129, 2048 };
+	static uint8_t buffer[check_max_size + 16] __attribute__((aligned(16)));
+	check_impl_t impls[] = {
+		{ "crc16_slice8", crc16_slice8 },
+		{ "crc16_clmul", crc16_clmul },
+	};
+	int nimpls = sizeof(impls) / sizeof(impls[0]);
+	int failed = 0;
+
+	if (!crc16_clmul_supported()) {
+		printf("crc16_clmul: not supported by this CPU, skipped\n");
+		nimpls--;
+	}
+
+	for (int i = 0; i < (int)sizeof(buffer); i++) {
+		buffer[i] = check_random();
+	}
+
+	for (int i = 0; i < nimpls; i++) {
+		int cases = 0;
+
+		// Block and tail boundaries of the folding and slicing loops
+		for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+			for (int offset = 0; offset < 16; offset++) {
+				failed += check_one(&impls[i], buffer + offset, sizes[s], 0xffff);
+				failed += check_one(&impls[i], buffer + offset, sizes[s], 0x0000);
+				cases += 2;
+			}
+		}
+
+		for (int run = 0; run < check_runs; run++) {
+			int size = check_random() % (check_max_size + 1);
+			int offset = check_random() % 16;
+			uint16_t init = check_random();
+
+			failed += check_one(&impls[i], buffer + offset, size, init);
+			cases++;
+		}
+
+		printf("%s: %d cases checked\n", impls[i].name, cases);
+	}
+
+	return failed;
+}
+
+/*
+ * An empty data record at an odd address populates nothing: page 1 has to
+ * stay out of the segments.
+ */
+static int check_hex(void)
+{
+	static const char text[] =
+		":0400000001020304F2\r\n"
+		":00080500F3\r\n"
+		":00000001FF\r\n";
+	hex_image_t image;
+	int failed = 0;
+
+	if (hex_parse(&image, text, sizeof(text) - 1)) {
+		fprintf(stderr, "hex: empty record at 0x0805 failed to parse\n");
+		return 1;
+	}
+
+	if (image.nsegments != 1 || image.segments[0].addr != 0 || image.segments[0].size != 4) {
+		fprintf(stderr, "hex: empty record at 0x0805 made %d segments\n", image.nsegments);
+		failed++;
+	}
+
+	printf("hex: 1 case checked\n");
+
+	hex_free(&image);
+
+	return failed;
+}
+
+/*
+ * Writes large enough to be burst, read back through instructions.
+ * Outside of SRAM they must not go through DMA0: the SFR range covers the
+ * DMA0 address, which a burst would restore over the written data.
+ */
+static int check_xdata(void)
+{
+	static const struct {
+		uint16_t addr;
+		int size;
+	} ranges[] = {
+		{ 0x0000, 64 },
+		{ 0x1000, 1024 },
+		{ 0x1fc0, 64 },
+		{ 0x6000, 64 },   // XREG
+		{ 0x70d0, 48 },   // SFR, DMA0_ADDR included
+	};
+	const ccd_config_t config = { .sim_options = "write=0,erase=0,chip-erase=0,dma=0" };
+	uint8_t data[1024];
+	uint8_t readback[1024];
+	ccd_ctx_t *ctx;
+	int failed = 0;
+	int cases = 0;
+
+	ctx = ccd_open(0, &config);
+	if (!ctx || ccd_enter_debug(ctx, 0)) {
+		fprintf(stderr, "xdata: can't open the simulator\n");
+		ccd_close(ctx);
+		return 1;
+	}
+
+	for (int i = 0; i < (int)(sizeof(ranges) / sizeof(ranges[0])); i++) {
+		uint16_t addr = ranges[i].addr;
+		int size = ranges[i].size;
+
+		for (int j = 0; j < size; j++) {
+			data[j] = check_random();
+		}
+
+		// Zeros keep DMA_ARM and DMA_REQ from starting anything
+		for (int j = 0; j < size; j++) {
+			if (addr + j == DMA_ARM || addr + j == DMA_REQ) {
+				data[j] = 0;
+			}
+		}
+
+		memset(readback, 0, size);
+		if (target_write_xdata(ctx, addr, data, size) ||
+		    target_read_xdata(ctx, addr, readback, size)) {
+			fprintf(stderr, "xdata: %dB at 0x%04x failed\n", size, addr);
+			failed++;
+		}
+		else if (memcmp(data, readback, size)) {
+			fprintf(stderr, "xdata: %dB at 0x%04x don't read back\n", size, addr);
+			failed++;
+		}
+		cases++;
+	}
+
+	printf("xdata: %d cases checked\n", cases);
+
+	ccd_close(ctx);
+
+	return failed;
+}
+
+/*
+ * The weak page loses the first write to it: the write fails its check
+ * and the page is erased and written again. The half written earlier,
+ * here by the initial flash image, has to survive the erase.
+ */
+static int check_flash_retry(void)
+{
+	enum {
+		weak_page = 3,
+		half = TARGET_FLASH_PAGE_SIZE / 2,
+	};
+	char image_file[] = "/tmp/ccd-check-XXXXXX";
+	char options[128];
+	ccd_config_t config = { .sim_options = options };
+	static uint8_t initial[(weak_page + 1) * TARGET_FLASH_PAGE_SIZE];
+	uint8_t data[half];
+	uint8_t readback[TARGET_FLASH_PAGE_SIZE];
+	ccd_ctx_t *ctx = NULL;
+	int failed = 0;
+	FILE *fp = NULL;
+	int fd;
+
+	memset(initial, 0xff, sizeof(initial));
+	for (int i = 0; i < half; i++) {
+		initial[weak_page * TARGET_FLASH_PAGE_SIZE + half + i] = check_random();
+		data[i] = check_random();
+	}
+
+	fd = mkstemp(image_file);
+	fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (!fp || fwrite(initial, sizeof(initial), 1, fp) != 1 || fclose(fp)) {
+		fprintf(stderr, "flash.retry: can't write %s\n", image_file);
+		if (fd >= 0) {
+			unlink(image_file);
+		}
+		return 1;
+	}
+
+	snprintf(options, sizeof(options), "write=0,erase=0,chip-erase=0,dma=0,weak=%d,image=%s",
+		weak_page, image_file);
+
+	ctx = ccd_open(0, &config);
+	unlink(image_file);
+	if (!ctx || ccd_enter_debug(ctx, 0)) {
+		fprintf(stderr, "flash.retry: can't open the simulator\n");
+		ccd_close(ctx);
+		return 1;
+	}
+
+	if (ccd_write_code(ctx, weak_page * TARGET_FLASH_PAGE_SIZE, data, half, ccd_write_erased) ||
+	    target_read_code(ctx, weak_page * TARGET_FLASH_PAGE_SIZE, readback, sizeof(readback))) {
+		fprintf(stderr, "flash.retry: write to weak page %d failed\n", weak_page);
+		failed++;
+	}
+	else if (memcmp(readback, data, half)) {
+		fprintf(stderr, "flash.retry: page %d doesn't hold the write\n", weak_page);
+		failed++;
+	}
+	else if (memcmp(readback + half, initial + weak_page * TARGET_FLASH_PAGE_SIZE + half, half)) {
+		fprintf(stderr, "flash.retry: page %d lost its earlier content\n", weak_page);
+		failed++;
+	}
+
+	printf("flash.retry: 1 case checked\n");
+
+	ccd_close(ctx);
+
+	return failed;
+}
+
+// Payload bytes recorded so far under a stats name
+static uint64_t check_stat_bytes(const char *name)
+{
+	char line[512];
+	char key[128];
+	unsigned long long count = 0;
+	unsigned long long bytes = 0;
+	FILE *fp = tmpfile();
+
+	if (!fp) {
+		return 0;
+	}
+
+	snprintf(key, sizeof(key), "\"%s\"", name);
+
+	stats_dump(fp);
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		char *entry = strstr(line, key);
+
+		if (entry && sscanf(entry + strlen(key), ": {\"count\": %llu, \"bytes\": %llu", &count, &bytes) == 2) {
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return bytes;
+}
+
+/*
+ * A differential write of an image with one page changed rewrites that
+ * page alone, whether the CRCs come with the image or from the data.
+ * Both the first and the last page are partly covered by the image.
+ */
+static int check_write_diff(void)
+{
+	enum {
+		first_page = 4,
+		image_addr = first_page * TARGET_FLASH_PAGE_SIZE + 1024,
+		image_size = 3 * TARGET_FLASH_PAGE_SIZE,
+	};
+	static const struct {
+		int page;
+		int with_crcs;
+		int rewritten;
+	} cases[] = {
+		{ 5, 1, TARGET_FLASH_PAGE_SIZE },
+		{ 7, 0, 1024 },
+	};
+	const ccd_config_t config = { .sim_options = "write=0,erase=0,chip-erase=0,dma=0" };
+	static uint8_t image[image_size];
+	static uint8_t flash[TARGET_FLASH_MAX_SIZE];
+	static uint16_t page_crcs[TARGET_FLASH_PAGES];
+	uint8_t readback[image_size];
+	ccd_ctx_t *ctx;
+	int failed = 0;
+	int cases_run = 0;
+
+	ctx = ccd_open(0, &config);
+	if (!ctx || ccd_enter_debug(ctx, 0)) {
+		fprintf(stderr, "write_diff: can't open the simulator\n");
+		ccd_close(ctx);
+		return 1;
+	}
+
+	stats_enable();
+
+	for (int i = 0; i < image_size; i++) {
+		image[i] = check_random();
+	}
+	if (ccd_write_code(ctx, image_addr, image, image_size, ccd_write_erased)) {
+		fprintf(stderr, "write_diff: first write failed\n");
+		failed++;
+		goto out;
+	}
+
+	for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+		uint32_t page_addr = (uint32_t)cases[c].page * TARGET_FLASH_PAGE_SIZE;
+		uint64_t written;
+
+		for (uint32_t a = page_addr; a < page_addr + TARGET_FLASH_PAGE_SIZE; a++) {
+			if (a >= image_addr && a < image_addr + image_size) {
+				image[a - image_addr] = check_random();
+			}
+		}
+
+		// What the flash holds once written, as a HEX image has it
+		memset(flash, 0xff, sizeof(flash));
+		memcpy(flash + image_addr, image, image_size);
+		for (int page = 0; page < TARGET_FLASH_PAGES; page++) {
+			page_crcs[page] = compute_crc16(flash + page * TARGET_FLASH_PAGE_SIZE, TARGET_FLASH_PAGE_SIZE, 0xffff);
+		}
+
+		written = check_stat_bytes("phase.write_block");
+
+		if (ccd_write_code_crcs(ctx, image_addr, image, image_size, ccd_write_diff,
+		        cases[c].with_crcs ? page_crcs : NULL) ||
+		    target_read_code(ctx, image_addr, readback, image_size)) {
+			fprintf(stderr, "write_diff: page %d failed\n", cases[c].page);
+			failed++;
+			continue;
+		}
+		cases_run++;
+
+		written = check_stat_bytes("phase.write_block") - written;
+		if (written != (uint64_t)cases[c].rewritten) {
+			fprintf(stderr, "write_diff: page %d changed, %lluB rewritten instead of %dB\n",
+				cases[c].page, (unsigned long long)written, cases[c].rewritten);
+			failed++;
+		}
+		if (memcmp(readback, image, image_size)) {
+			fprintf(stderr, "write_diff: page %d changed, image doesn't read back\n", cases[c].page);
+			failed++;
+		}
+	}
+
+	printf("write_diff: %d cases checked\n", cases_run);
+
+out:
+	ccd_close(ctx);
+
+	return failed;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	log_set(log_off);
+
+	failed += check_crc16();
+	failed += check_hex();
+	failed += check_xdata();
+	failed += check_flash_retry();
+	failed += check_write_diff();
+
+	if (failed) {
+		fprintf(stderr, "%d mismatches\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
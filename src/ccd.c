@@ -22,9 +22,12 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "ccd.h"
+#include "crc.h"
+#include "stats.h"
 #include "target.h"
 
 static err_t get_state(ccd_ctx_t *ctx, uint8_t *state)
@@ -51,21 +54,40 @@ static err_t debug_enter(ccd_ctx_t *ctx)
 	return usb_control_transfer(ctx->usb, USB_OUT, VENDOR_DEBUG, 0, 0, NULL, 0);
 }
 
-ccd_ctx_t *ccd_open(void)
+int ccd_count(const ccd_config_t *config)
+{
+	return usb_count_devices(config, CCD_USB_VENDOR_ID, CCD_USB_PRODUCT_ID);
+}
+
+ccd_ctx_t *ccd_open(int index, const ccd_config_t *config)
 {
 	ccd_ctx_t *ctx;
 
-	log_print("[CCD] Open device\n");
+	log_print("[CCD] Open device %d\n", index);
 
 	ctx = malloc(sizeof(*ctx));
 	if (!ctx) {
 		error_out("Can't allocate memory\n");
 	}
 
-	ctx->usb = usb_open_device(CCD_USB_VENDOR_ID, CCD_USB_PRODUCT_ID);
+	ctx->cmd = NULL;
+	ctx->cmd_capacity = 0;
+	wait_model_init(&ctx->wait);
 
-out:
+	ctx->usb = usb_open_device(config, CCD_USB_VENDOR_ID, CCD_USB_PRODUCT_ID, index);
 	if (!ctx->usb) {
+		goto out;
+	}
+
+	// Sized for the flash path, so it never has to grow while flashing
+	if (target_command_reserve(ctx, TARGET_CMD_CAPACITY)) {
+		usb_close_device(ctx->usb);
+		ctx->usb = NULL;
+	}
+
+out:
+	if (ctx && !ctx->usb) {
+		free(ctx->cmd);
 		free(ctx);
 		ctx = NULL;
 	}
@@ -79,6 +101,7 @@ void ccd_close(ccd_ctx_t *ctx)
 
 	if (ctx) {
 		usb_close_device(ctx->usb);
+		free(ctx->cmd);
 		free(ctx);
 	}
 }
@@ -95,7 +118,8 @@ err_t ccd_enter_debug(ccd_ctx_t *ctx, int slow_mode)
 	err = get_state(ctx, &state);
 	noerr_or_out(err);
 	if (state != 0) {
-		error_out("Bad state %d", state);
+		err = err_failed;
+		error_out("Bad state %d\n", state);
 	}
 
 	err = set_speed(ctx, slow_mode ? 0 : 1);
@@ -115,6 +139,7 @@ err_t ccd_enter_debug(ccd_ctx_t *ctx, int slow_mode)
 	noerr_or_out(err);
 
 	if (cc_status & STATUS_DEBUG_LOCKED) {
+		err = err_failed;
 		error_out("Target is locked\n");
 	}
 
@@ -135,6 +160,26 @@ out:
 	return err;
 }
 
+err_t ccd_check_debug(ccd_ctx_t *ctx, int *in_debug)
+{
+	err_t err;
+	uint8_t cc_status;
+
+	log_print("[CCD] Check debug mode\n");
+
+	*in_debug = 0;
+
+	err = target_read_status(ctx, &cc_status);
+	noerr_or_out(err);
+
+	// A target that isn't in debug mode doesn't answer, the line reads high
+	*in_debug = cc_status != 0xff && (cc_status & STATUS_CPU_HALTED) &&
+		!(cc_status & STATUS_DEBUG_LOCKED);
+
+out:
+	return err;
+}
+
 err_t ccd_reset(ccd_ctx_t *ctx)
 {
 	return reset(ctx, 0);
@@ -146,21 +191,36 @@ err_t ccd_fw_info(ccd_ctx_t *ctx, ccd_fw_info_t *info)
 	return usb_control_transfer(ctx->usb, USB_IN, VENDOR_GET_INFO, 0, 0, info, sizeof(*info));
 }
 
+static err_t erase_poll(void *arg, int *done)
+{
+	err_t err;
+	uint8_t cc_status;
+
+	err = target_read_status(arg, &cc_status);
+	noerr_or_out(err);
+
+	*done = !(cc_status & STATUS_ERASE_BUSY);
+
+out:
+	return err;
+}
+
 err_t ccd_erase(ccd_ctx_t *ctx)
 {
 	err_t err = err_failed;
-	uint8_t cc_status;
+	uint64_t start_ns = stats_begin();
+	uint64_t start;
 
 	log_print("[CCD] Erase flash\n");
 
 	err = target_erase(ctx);
 	noerr_or_out(err);
+	start = wait_now_us();
 
-	do {
-		usleep(500);
-		err = target_read_status(ctx, &cc_status);
-		noerr_or_out(err);
-	} while (cc_status & STATUS_ERASE_BUSY);
+	err = wait_until(&ctx->wait, wait_chip_erase, 1, start, erase_poll, ctx);
+	noerr_or_out(err);
+
+	stats_record("phase.erase", start_ns, 0);
 
 out:
 	return err;
@@ -172,6 +232,7 @@ err_t ccd_target_info(ccd_ctx_t *ctx, ccd_target_info_t *info)
 	uint8_t chip_id;
 	uint8_t chip_version;
 	uint16_t chip_info;
+	target_txn_t txn = { .cmd_size = 0 };
 	enum {
 		flash_size_mask  = 0x0070,
 		flash_size_shift = 4,
@@ -181,19 +242,19 @@ err_t ccd_target_info(ccd_ctx_t *ctx, ccd_target_info_t *info)
 
 	log_print("[CCD] Get target info\n");
 
-	err = ccd_read_xdata(
-		ctx, MEM_CHIP_ID,
-		&chip_id, sizeof(chip_id));
+	err = target_txn_init(ctx, &txn);
 	noerr_or_out(err);
 
-	err = ccd_read_xdata(
-		ctx, MEM_CHIP_VERSION,
-		&chip_version, sizeof(chip_version));
+	err = target_txn_read(&txn, MEM_CHIP_ID, &chip_id, sizeof(chip_id));
 	noerr_or_out(err);
 
-	err = ccd_read_xdata(
-		ctx, MEM_CHIP_INFO,
-		&chip_info, sizeof(chip_info));
+	err = target_txn_read(&txn, MEM_CHIP_VERSION, &chip_version, sizeof(chip_version));
+	noerr_or_out(err);
+
+	err = target_txn_read(&txn, MEM_CHIP_INFO, (uint8_t *)&chip_info, sizeof(chip_info));
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
 	noerr_or_out(err);
 
 	info->chip_id = chip_id;
@@ -204,6 +265,7 @@ err_t ccd_target_info(ccd_ctx_t *ctx, ccd_target_info_t *info)
 		((chip_info & sram_size_mask) >> sram_size_shift) + 1;
 
 out:
+	target_txn_abort(&txn);
 	return err;
 }
 
@@ -220,6 +282,19 @@ out:
 	return err;
 }
 
+err_t ccd_read_code(ccd_ctx_t *ctx, uint32_t addr, void *data, int size)
+{
+	err_t err = err_failed;
+
+	log_print("[CCD] Read %dB at 0x%05x in code memory\n", size, addr);
+
+	err = target_read_code(ctx, addr, data, size);
+	noerr_or_out(err);
+
+out:
+	return err;
+}
+
 err_t ccd_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const void *data, int size)
 {
 	err_t err = err_failed;
@@ -233,18 +308,124 @@ out:
 	return err;
 }
 
-err_t ccd_write_code(ccd_ctx_t *ctx, uint16_t addr, const void *data, int size)
+static err_t write_code_diff(ccd_ctx_t *ctx, uint32_t addr, const void *data, int size, const uint16_t *page_crcs)
 {
 	err_t err = err_failed;
+	const uint8_t *code = data;
+	int first_page = addr / TARGET_FLASH_PAGE_SIZE;
+	int count = (addr + size - 1) / TARGET_FLASH_PAGE_SIZE - first_page + 1;
+	uint16_t crcs[TARGET_FLASH_MAX_SIZE / TARGET_FLASH_PAGE_SIZE];
+	uint8_t page_data[TARGET_FLASH_PAGE_SIZE];
+	int changed = 0;
+	int run_start = -1;
+
+	log_print("[CCD] Differential write of %dB at 0x%05x in code memory\n", size, addr);
+
+	if (size <= 0) {
+		err = err_none;
+		goto out;
+	}
 
-	log_print("[CCD] Write %dB at 0x%04x in code memory\n", size, addr);
-
-	err = target_write_flash(ctx, addr, data, size);
+	err = target_read_page_crcs(ctx, first_page, count, crcs);
 	noerr_or_out(err);
 
-	err = target_verify_flash(ctx, addr, data, size);
+	// Rewrite runs of consecutive pages whose content differs
+	for (int i = 0; i <= count; i++) {
+		int differs = 0;
+
+		if (i < count && page_crcs) {
+			differs = page_crcs[first_page + i] != crcs[i];
+		}
+		else if (i < count) {
+			uint32_t page_addr = (uint32_t)(first_page + i) * TARGET_FLASH_PAGE_SIZE;
+			uint32_t start = page_addr > addr ? page_addr : addr;
+			uint32_t end = page_addr + TARGET_FLASH_PAGE_SIZE;
+
+			if (end > addr + size) {
+				end = addr + size;
+			}
+
+			// Outside of the image the page is expected erased
+			memset(page_data, 0xff, sizeof(page_data));
+			memcpy(page_data + (start - page_addr), code + (start - addr), end - start);
+
+			differs = compute_crc16(page_data, sizeof(page_data), 0xffff) != crcs[i];
+		}
+
+		if (differs && run_start < 0) {
+			run_start = i;
+		}
+		else if (!differs && run_start >= 0) {
+			uint32_t start = (uint32_t)(first_page + run_start) * TARGET_FLASH_PAGE_SIZE;
+			uint32_t end = (uint32_t)(first_page + i) * TARGET_FLASH_PAGE_SIZE;
+
+			if (start < addr) {
+				start = addr;
+			}
+			if (end > addr + size) {
+				end = addr + size;
+			}
+
+			err = target_write_flash(ctx, start, code + (start - addr), end - start,
+				TARGET_WRITE_ERASE | TARGET_WRITE_VERIFY);
+			noerr_or_out(err);
+
+			changed += i - run_start;
+			run_start = -1;
+		}
+	}
+
+	log_print("[CCD] %d of %d pages changed\n", changed, count);
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+err_t ccd_write_code(ccd_ctx_t *ctx, uint32_t addr, const void *data, int size, ccd_write_mode_t mode)
+{
+	return ccd_write_code_crcs(ctx, addr, data, size, mode, NULL);
+}
+
+err_t ccd_write_code_crcs(ccd_ctx_t *ctx, uint32_t addr, const void *data, int size,
+	ccd_write_mode_t mode, const uint16_t *page_crcs)
+{
+	err_t err = err_failed;
+
+	log_print("[CCD] Write %dB at 0x%05x in code memory\n", size, addr);
+
+	if (mode == ccd_write_diff) {
+		err = write_code_diff(ctx, addr, data, size, page_crcs);
+		noerr_or_out(err);
+		goto out;
+	}
+
+	err = target_write_flash(ctx, addr, data, size,
+		(mode == ccd_write_pages ? TARGET_WRITE_ERASE : 0) | TARGET_WRITE_VERIFY);
 	noerr_or_out(err);
 
 out:
 	return err;
 }
+
+err_t ccd_erase_pages(ccd_ctx_t *ctx, int first_page, int count)
+{
+	err_t err = err_failed;
+
+	log_print("[CCD] Erase %d flash pages from page %d\n", count, first_page);
+
+	if (first_page < 0 || first_page + count > TARGET_FLASH_MAX_SIZE / TARGET_FLASH_PAGE_SIZE) {
+		error_out("Bad flash page range %d-%d\n", first_page, first_page + count - 1);
+	}
+
+	for (int page = first_page; page < first_page + count; page++) {
+		err = target_erase_page(ctx, page);
+		noerr_or_out(err);
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
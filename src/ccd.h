@@ -26,38 +26,25 @@
 
 #include "usb.h"
 #include "tools.h"
+#include "wait.h"
 
-typedef struct ccd_ctx_t {
+struct ccd_ctx_t {
 	usb_ctx_t *usb;
-} ccd_ctx_t;
 
-ccd_ctx_t *ccd_open(void);
-void ccd_close(ccd_ctx_t *ctx);
+	// Debug command arena, reused by every target transaction
+	uint8_t *cmd;
+	int cmd_capacity;
 
-typedef struct __attribute__((packed)) {
-	uint16_t chip;
-	uint16_t fw_id;
-	uint16_t fw_rev;
-	uint16_t dontknow;
-} ccd_fw_info_t;
+	// Timings learnt from the target
+	wait_model_t wait;
+};
 
-typedef struct {
-	int chip_id;
-	int chip_version;
-	int flash_size;
-	int sram_size;
-} ccd_target_info_t;
-
-err_t ccd_enter_debug(ccd_ctx_t *ctx, int slow_mode);
-err_t ccd_leave_debug(ccd_ctx_t *ctx);
-
-err_t ccd_fw_info(ccd_ctx_t *ctx, ccd_fw_info_t *info);
-err_t ccd_target_info(ccd_ctx_t *ctx, ccd_target_info_t *info);
-err_t ccd_reset(ccd_ctx_t *ctx);
-err_t ccd_erase(ccd_ctx_t *ctx);
-
-err_t ccd_read_xdata(ccd_ctx_t *ctx, uint16_t addr, void *data, int size);
-err_t ccd_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const void *data, int size);
-err_t ccd_write_code(ccd_ctx_t *ctx, uint16_t addr, const void *data, int size);
+/**
+ * Same as ccd_write_code(), with the CRC16 of every flash page as the code
+ * leaves it, indexed by page. Differential writes compare against them
+ * instead of hashing the code again.
+ */
+err_t ccd_write_code_crcs(ccd_ctx_t *ctx, uint32_t addr, const void *data, int size,
+	ccd_write_mode_t mode, const uint16_t *page_crcs);
 
 #endif
@@ -0,0 +1,225 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_HAVE_CLMUL 1
+#endif
+
+enum {
+	CRC16_POLY = 0x8005,
+	CRC16_SLICES = 8,
+};
+
+static uint16_t crc16_table[CRC16_SLICES][256];
+
+/**
+ * Reference implementation, one bit at a time.
+ */
+uint16_t crc16_bitwise(const uint8_t *data, int size, uint16_t init)
+{
+	uint16_t crc16 = init;
+
+	for (int i = 0; i < size; i++) {
+		uint8_t byte = *data++;
+		for (int b = 7; b >= 0; b-- ) {
+			uint8_t in_sum = ((crc16 & 0x8000) >> 15) ^ ((byte >> b) & 1);
+			crc16 = (crc16 << 1) | in_sum;
+			crc16 = crc16 ^ (in_sum << 15);
+			crc16 = crc16 ^ (in_sum << 2);
+		}
+	}
+
+	return crc16;
+}
+
+/**
+ * Slice-by-8: table k holds the CRC of a byte followed by k zero bytes.
+ */
+uint16_t crc16_slice8(const uint8_t *data, int size, uint16_t init)
+{
+	uint16_t crc16 = init;
+
+	while (size >= CRC16_SLICES) {
+		crc16 = crc16_table[7][data[0] ^ (crc16 >> 8)] ^
+			crc16_table[6][data[1] ^ (crc16 & 0xff)] ^
+			crc16_table[5][data[2]] ^
+			crc16_table[4][data[3]] ^
+			crc16_table[3][data[4]] ^
+			crc16_table[2][data[5]] ^
+			crc16_table[1][data[6]] ^
+			crc16_table[0][data[7]];
+		data += CRC16_SLICES;
+		size -= CRC16_SLICES;
+	}
+
+	while (size--) {
+		crc16 = (crc16 << 8) ^ crc16_table[0][*data++ ^ (crc16 >> 8)];
+	}
+
+	return crc16;
+}
+
+/**
+ * x^n mod P
+ */
+static uint64_t xpow_mod(int n)
+{
+	uint32_t rem = 1;
+
+	while (n--) {
+		rem <<= 1;
+		if (rem & 0x10000) {
+			rem ^= 0x10000 | CRC16_POLY;
+		}
+	}
+
+	return rem;
+}
+
+#ifdef CRC_HAVE_CLMUL
+
+/*
+ * Blocks are byte swapped so that bit 127 of a register is the first bit
+ * of the message. Folding a block over n bits replaces its high and low
+ * halves with their products by x^(n+64) mod P and x^n mod P, which keeps
+ * the message congruent modulo P. The last block is left to the tables.
+ */
+static __m128i crc16_k128;
+static __m128i crc16_k256;
+static __m128i crc16_k384;
+static __m128i crc16_k512;
+
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+
+CLMUL_TARGET static inline __m128i clmul_fold(__m128i acc, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00),
+		_mm_clmulepi64_si128(acc, k, 0x11));
+}
+
+CLMUL_TARGET uint16_t crc16_clmul(const uint8_t *data, int size, uint16_t init)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i acc[4];
+	uint8_t last[16];
+
+	if (size < 64) {
+		return crc16_slice8(data, size, init);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		acc[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + i), swap);
+	}
+	acc[0] = _mm_xor_si128(acc[0], _mm_set_epi64x((uint64_t)init << 48, 0));
+	data += 64;
+	size -= 64;
+
+	// Four independent lanes hide the multiplier latency
+	while (size >= 64) {
+		for (int i = 0; i < 4; i++) {
+			__m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + i), swap);
+			acc[i] = _mm_xor_si128(clmul_fold(acc[i], crc16_k512), block);
+		}
+		data += 64;
+		size -= 64;
+	}
+
+	acc[3] = _mm_xor_si128(acc[3], clmul_fold(acc[0], crc16_k384));
+	acc[3] = _mm_xor_si128(acc[3], clmul_fold(acc[1], crc16_k256));
+	acc[3] = _mm_xor_si128(acc[3], clmul_fold(acc[2], crc16_k128));
+
+	while (size >= 16) {
+		__m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), swap);
+		acc[3] = _mm_xor_si128(clmul_fold(acc[3], crc16_k128), block);
+		data += 16;
+		size -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)last, _mm_shuffle_epi8(acc[3], swap));
+
+	return crc16_slice8(data, size, crc16_slice8(last, sizeof(last), 0));
+}
+
+static __m128i fold_constants(int n)
+{
+	return _mm_set_epi64x(xpow_mod(n + 64), xpow_mod(n));
+}
+
+#else
+
+uint16_t crc16_clmul(const uint8_t *data, int size, uint16_t init)
+{
+	return crc16_slice8(data, size, init);
+}
+
+#endif
+
+int crc16_clmul_supported(void)
+{
+#ifdef CRC_HAVE_CLMUL
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#else
+	return 0;
+#endif
+}
+
+static uint16_t (*crc16_impl)(const uint8_t *data, int size, uint16_t init) = crc16_bitwise;
+
+__attribute__((constructor)) static void crc16_init(void)
+{
+	for (int b = 0; b < 256; b++) {
+		crc16_table[0][b] = crc16_bitwise((uint8_t[]){ b }, 1, 0);
+	}
+
+	for (int k = 1; k < CRC16_SLICES; k++) {
+		for (int b = 0; b < 256; b++) {
+			uint16_t prev = crc16_table[k - 1][b];
+			crc16_table[k][b] = (prev << 8) ^ crc16_table[0][prev >> 8];
+		}
+	}
+
+	crc16_impl = crc16_slice8;
+
+#ifdef CRC_HAVE_CLMUL
+	// The constants are set up either way, so the check can run crc16_clmul()
+	crc16_k128 = fold_constants(128);
+	crc16_k256 = fold_constants(256);
+	crc16_k384 = fold_constants(384);
+	crc16_k512 = fold_constants(512);
+
+	if (crc16_clmul_supported()) {
+		crc16_impl = crc16_clmul;
+	}
+#endif
+}
+
+uint16_t compute_crc16(const uint8_t *data, int size, uint16_t init)
+{
+	return crc16_impl(data, size, init);
+}
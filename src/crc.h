@@ -0,0 +1,46 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+/**
+ * CRC16 as computed by the RNG peripheral:
+ * polynomial 0x8005, MSB first, no final xor.
+ * Uses carry-less multiplication when the CPU has it, tables otherwise.
+ */
+uint16_t compute_crc16(const uint8_t *data, int size, uint16_t init);
+
+/*
+ * The implementations compute_crc16() picks from, for `make check` to hold
+ * against the bitwise reference. crc16_clmul() only runs on CPUs where
+ * crc16_clmul_supported().
+ */
+uint16_t crc16_bitwise(const uint8_t *data, int size, uint16_t init);
+uint16_t crc16_slice8(const uint8_t *data, int size, uint16_t init);
+uint16_t crc16_clmul(const uint8_t *data, int size, uint16_t init);
+int crc16_clmul_supported(void);
+
+#endif
@@ -0,0 +1,538 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "ccd.h"
+#include "dump.h"
+#include "hex.h"
+
+enum {
+	// A client that stalls doesn't hold the debugger for longer
+	daemon_timeout_s = 5,
+};
+
+typedef struct {
+	ccd_ctx_t *ctx;
+	const ccd_config_t *config;
+	int slow_mode;
+	int in_debug;
+} daemon_t;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+/*
+ * Written by the signal handler and polled next to the socket: a signal
+ * that lands just before the wait still ends it, whichever thread got it.
+ */
+static int daemon_wake[2] = { -1, -1 };
+
+static void daemon_signal(int sig)
+{
+	int saved_errno = errno;
+	ssize_t ret;
+
+	(void)sig;
+	daemon_stop = 1;
+
+	ret = write(daemon_wake[1], "", 1);
+	(void)ret;
+
+	errno = saved_errno;
+}
+
+static int daemon_nonblock(int fd, int nonblock)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0) {
+		return -1;
+	}
+
+	return fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static err_t daemon_address(const char *path, struct sockaddr_un *addr)
+{
+	err_t err = err_failed;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		error_out("Socket path too long: %s\n", path);
+	}
+	strcpy(addr->sun_path, path);
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static void daemon_close(daemon_t *daemon)
+{
+	ccd_close(daemon->ctx);
+	daemon->ctx = NULL;
+	daemon->in_debug = 0;
+}
+
+/*
+ * Get the debugger open and the target in debug mode, keeping what the
+ * previous jobs left as long as it's still there.
+ */
+static err_t daemon_prepare(daemon_t *daemon, FILE *out)
+{
+	err_t err = err_failed;
+	ccd_fw_info_t fw_info;
+
+	if (daemon->ctx && daemon->in_debug) {
+		err = ccd_check_debug(daemon->ctx, &daemon->in_debug);
+		if (!err && daemon->in_debug) {
+			log_print("[Daemon] Target still in debug mode\n");
+			goto out;
+		}
+
+		// Start over with a debugger that doesn't answer anymore
+		if (err) {
+			daemon_close(daemon);
+		}
+		fprintf(out, "Target changed\n");
+	}
+
+	if (!daemon->ctx) {
+		daemon->ctx = ccd_open(0, daemon->config);
+		if (!daemon->ctx) {
+			err = err_failed;
+			goto out;
+		}
+
+		err = ccd_fw_info(daemon->ctx, &fw_info);
+		noerr_or_out(err);
+
+		fprintf(out, "CC-Debugger: FW 0x%04x rev 0x%04x\n", fw_info.fw_id, fw_info.fw_rev);
+
+		if (fw_info.chip == 0) {
+			err = err_failed;
+			error_out("No target found\n");
+		}
+
+		fprintf(out, "Target: CC%x\n", fw_info.chip);
+	}
+
+	err = ccd_enter_debug(daemon->ctx, daemon->slow_mode);
+	noerr_or_out(err);
+
+	daemon->in_debug = 1;
+
+out:
+	return err;
+}
+
+static err_t daemon_job(daemon_t *daemon, char *line, FILE *out)
+{
+	err_t err = err_failed;
+	hex_image_t image = { .buffer = NULL };
+	ccd_target_info_t target_info;
+	char *arg;
+
+	arg = strchr(line, ' ');
+	if (arg) {
+		*arg++ = '\0';
+	}
+
+	log_print("[Daemon] Job %s %s\n", line, arg ? arg : "");
+
+	if (!strcmp(line, "info")) {
+		err = ccd_target_info(daemon->ctx, &target_info);
+		noerr_or_out(err);
+
+		fprintf(out, " Chip ID: 0x%x\n", target_info.chip_id);
+		fprintf(out, " Chip version: %d\n", target_info.chip_version);
+		fprintf(out, " Flash size: %d KB\n", target_info.flash_size);
+		fprintf(out, " SRAM size: %d KB\n", target_info.sram_size);
+	}
+	else if (!strcmp(line, "erase")) {
+		fprintf(out, "Erasing flash...\n");
+		err = ccd_erase(daemon->ctx);
+		noerr_or_out(err);
+	}
+	else if (!strcmp(line, "hex") && arg && strchr(arg, ' ')) {
+		ccd_write_mode_t mode;
+		char *file = strchr(arg, ' ');
+
+		*file++ = '\0';
+
+		if (!strcmp(arg, "erased")) {
+			mode = ccd_write_erased;
+		}
+		else if (!strcmp(arg, "pages")) {
+			mode = ccd_write_pages;
+		}
+		else if (!strcmp(arg, "diff")) {
+			mode = ccd_write_diff;
+		}
+		else {
+			error_out("Bad write mode %s\n", arg);
+		}
+
+		err = hex_load(&image, file);
+		noerr_or_out(err);
+
+		fprintf(out, "Writing HEX to flash...\n");
+		err = hex_write(daemon->ctx, &image, mode);
+		noerr_or_out(err);
+	}
+	else if (!strcmp(line, "verify") && arg) {
+		err = hex_load(&image, arg);
+		noerr_or_out(err);
+
+		fprintf(out, "Verifying flash...\n");
+		err = hex_verify(daemon->ctx, &image);
+		noerr_or_out(err);
+	}
+	else if ((!strcmp(line, "dump") || !strcmp(line, "dump-xdata")) && arg) {
+		err = ccd_target_info(daemon->ctx, &target_info);
+		noerr_or_out(err);
+
+		if (!strcmp(line, "dump")) {
+			fprintf(out, "Dumping flash...\n");
+			err = dump_memory(daemon->ctx, dump_code, 0, target_info.flash_size * 1024, arg);
+		}
+		else {
+			fprintf(out, "Dumping SRAM...\n");
+			err = dump_memory(daemon->ctx, dump_xdata, 0, target_info.sram_size * 1024, arg);
+		}
+		noerr_or_out(err);
+	}
+	else {
+		error_out("Bad job %s\n", line);
+	}
+
+out:
+	hex_free(&image);
+	return err;
+}
+
+/*
+ * Tell the client what failed and why, the reason being the last error
+ * this thread printed.
+ */
+static void daemon_error(FILE *out, const char *what)
+{
+	const char *reason = error_last();
+	int size = strcspn(reason, "\n");
+
+	if (size) {
+		fprintf(out, "Error: %s: %.*s\n", what, size, reason);
+	}
+	else {
+		fprintf(out, "Error: %s failed\n", what);
+	}
+}
+
+static void daemon_connection(daemon_t *daemon, int fd)
+{
+	err_t err = err_failed;
+	FILE *in = NULL;
+	FILE *out = NULL;
+	char *jobs = NULL;
+	size_t jobs_capacity = 0;
+	ssize_t jobs_size;
+	char *line;
+	char *next;
+	uint64_t start = wait_now_us();
+	struct timeval timeout = { .tv_sec = daemon_timeout_s };
+	int started = 0;
+	int conn;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	conn = dup(fd);
+	in = fdopen(fd, "r");
+	out = conn >= 0 ? fdopen(conn, "w") : NULL;
+	if (!in || !out) {
+		if (!in) {
+			close(fd);
+		}
+		if (!out && conn >= 0) {
+			close(conn);
+		}
+		error_out("Can't open connection\n");
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	// Everything is read first, the client waits for the end of it
+	jobs_size = getdelim(&jobs, &jobs_capacity, '\0', in);
+	if (ferror(in)) {
+		error_out("Can't read jobs: %s\n", errno == EAGAIN ? "timed out" : strerror(errno));
+	}
+
+	started = 1;
+	error_clear();
+	err = daemon_prepare(daemon, out);
+	if (err) {
+		daemon_error(out, "debugger setup");
+		goto out;
+	}
+
+	for (line = jobs; jobs_size > 0 && *line; line = next) {
+		next = line + strcspn(line, "\n");
+		if (*next) {
+			*next++ = '\0';
+		}
+		line[strcspn(line, "\r")] = '\0';
+
+		if (*line) {
+			size_t line_size = strlen(line);
+
+			error_clear();
+			err = daemon_job(daemon, line, out);
+			if (err) {
+				// The job was split in place, put its arguments back
+				for (size_t i = 0; i < line_size; i++) {
+					line[i] = line[i] ? line[i] : ' ';
+				}
+				daemon_error(out, line);
+				goto out;
+			}
+		}
+	}
+
+	fprintf(out, "Done.\n");
+
+out:
+	printf("Jobs %s in %.1f s\n", err ? "failed" : "done", (wait_now_us() - start) / 1e6);
+	fflush(stdout);
+
+	// Whatever failed on the target, the next jobs start from a fresh device
+	if (err && started) {
+		daemon_close(daemon);
+	}
+
+	if (out) {
+		fprintf(out, "%s\n", err ? "FAIL" : "OK");
+		fclose(out);
+	}
+	if (in) {
+		fclose(in);
+	}
+	free(jobs);
+}
+
+err_t daemon_serve(const char *path, const ccd_config_t *config, int slow_mode)
+{
+	err_t err = err_failed;
+	daemon_t daemon = { .ctx = NULL, .config = config, .slow_mode = slow_mode };
+	struct sockaddr_un addr;
+	struct sigaction action;
+	struct stat st;
+	int fd = -1;
+	int bound = 0;
+
+	err = daemon_address(path, &addr);
+	noerr_or_out(err);
+	err = err_failed;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		error_out("Can't create socket: %s\n", strerror(errno));
+	}
+
+	// Take over a socket left behind, not one that is still served
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+		if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			error_out("A daemon already listens on %s\n", path);
+		}
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		error_out("Can't bind %s: %s\n", path, strerror(errno));
+	}
+	bound = 1;
+
+	if (listen(fd, 8)) {
+		error_out("Can't listen on %s: %s\n", path, strerror(errno));
+	}
+
+	// A connection reset between poll() and accept() mustn't block
+	if (daemon_nonblock(fd, 1)) {
+		error_out("Can't set up %s: %s\n", path, strerror(errno));
+	}
+
+	if (pipe(daemon_wake) || daemon_nonblock(daemon_wake[0], 1) || daemon_nonblock(daemon_wake[1], 1)) {
+		error_out("Can't create pipe: %s\n", strerror(errno));
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = daemon_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Warm up right away, the first job shouldn't pay for it either
+	if (daemon_prepare(&daemon, stdout)) {
+		daemon_close(&daemon);
+	}
+
+	printf("Listening on %s\n", path);
+	fflush(stdout);
+
+	while (!daemon_stop) {
+		struct pollfd fds[2] = {
+			{ .fd = fd, .events = POLLIN },
+			{ .fd = daemon_wake[0], .events = POLLIN },
+		};
+		int conn;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error_out("Can't wait for connections: %s\n", strerror(errno));
+		}
+
+		// Stop is set before the pipe is written
+		if (fds[1].revents || !fds[0].revents) {
+			continue;
+		}
+
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;
+			}
+			error_out("Can't accept connection: %s\n", strerror(errno));
+		}
+
+		// Some systems have it inherit the listening socket flags
+		daemon_nonblock(conn, 0);
+
+		daemon_connection(&daemon, conn);
+	}
+
+	err = err_none;
+
+out:
+	// Let the target run what it was flashed with
+	if (daemon.in_debug) {
+		ccd_leave_debug(daemon.ctx);
+	}
+	daemon_close(&daemon);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (bound) {
+		unlink(path);
+	}
+
+	// Further signals go to the default action rather than a closed pipe
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	for (int i = 0; i < 2; i++) {
+		if (daemon_wake[i] >= 0) {
+			close(daemon_wake[i]);
+			daemon_wake[i] = -1;
+		}
+	}
+
+	return err;
+}
+
+err_t daemon_submit(const char *path, const char *jobs)
+{
+	err_t err = err_failed;
+	struct sockaddr_un addr;
+	size_t size = strlen(jobs);
+	FILE *in = NULL;
+	char *line = NULL;
+	size_t capacity = 0;
+	int fd = -1;
+
+	err = daemon_address(path, &addr);
+	noerr_or_out(err);
+	err = err_failed;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		error_out("Can't create socket: %s\n", strerror(errno));
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		error_out("Can't connect to %s: %s\n", path, strerror(errno));
+	}
+
+	while (size) {
+		ssize_t sent = send(fd, jobs, size, MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			error_out("Can't send jobs: %s\n", strerror(errno));
+		}
+		jobs += sent;
+		size -= sent;
+	}
+	shutdown(fd, SHUT_WR);
+
+	in = fdopen(fd, "r");
+	if (!in) {
+		error_out("Can't open connection\n");
+	}
+	fd = -1;
+
+	while (getline(&line, &capacity, in) > 0) {
+		if (!strcmp(line, "OK\n")) {
+			err = err_none;
+			goto out;
+		}
+		if (!strcmp(line, "FAIL\n")) {
+			error_out("Jobs failed\n");
+		}
+
+		fputs(line, strncmp(line, "Error: ", 7) ? stdout : stderr);
+		fflush(stdout);
+	}
+
+	error_out("Daemon closed the connection\n");
+
+out:
+	if (in) {
+		fclose(in);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(line);
+	return err;
+}
@@ -0,0 +1,53 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "tools.h"
+
+/**
+ * Serve jobs on a UNIX socket until interrupted, keeping the debugger
+ * open and the target in debug mode in between. Debug mode is only
+ * entered again once the target was reset or replaced.
+ *
+ * A connection sends one job per line and gets the progress back, ended
+ * by an "OK" or "FAIL" line. Jobs stop at the first failure, which is
+ * reported by an "Error: <job>: <reason>" line before "FAIL":
+ *   info
+ *   erase
+ *   hex <erased|pages|diff> <file>  Write and verify a HEX file
+ *   verify <file>                   Verify the flash against a HEX file
+ *   dump <file>                     Read the flash to a file
+ *   dump-xdata <file>               Read the SRAM to a file
+ * Files are opened by the daemon, relative paths are relative to its
+ * working directory. ccd --connect only sends absolute paths.
+ */
+err_t daemon_serve(const char *path, const ccd_config_t *config, int slow_mode);
+
+/**
+ * Send jobs to a daemon and print its progress on stdout.
+ */
+err_t daemon_submit(const char *path, const char *jobs);
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dump.h"
+
+enum {
+	hex_record_size = 16,
+	hex_line_overhead = 12, // :CCAAAATT + SS + \n
+};
+
+static int is_hex_file(const char *file)
+{
+	const char *ext = strrchr(file, '.');
+
+	return ext && (!strcasecmp(ext, ".hex") || !strcasecmp(ext, ".ihex"));
+}
+
+static int is_erased(const uint8_t *data, int size)
+{
+	for (int i = 0; i < size; i++) {
+		if (data[i] != 0xff) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static char *hex_record(char *out, int type, uint16_t addr, const uint8_t *data, int size)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	uint8_t sum = size + (addr >> 8) + (addr & 0xff) + type;
+	uint8_t header[4] = { size, addr >> 8, addr & 0xff, type };
+
+	*out++ = ':';
+	for (int i = 0; i < 4; i++) {
+		*out++ = digits[header[i] >> 4];
+		*out++ = digits[header[i] & 0xf];
+	}
+	for (int i = 0; i < size; i++) {
+		*out++ = digits[data[i] >> 4];
+		*out++ = digits[data[i] & 0xf];
+		sum += data[i];
+	}
+
+	sum = -sum;
+	*out++ = digits[sum >> 4];
+	*out++ = digits[sum & 0xf];
+	*out++ = '\n';
+
+	return out;
+}
+
+/*
+ * Returns the size of the HEX text, and also writes it when out is set.
+ */
+static size_t hex_format(char *out, uint32_t addr, const uint8_t *data, int size)
+{
+	size_t length = 0;
+	int high = 0;
+
+	for (int offset = 0; offset < size; offset += hex_record_size) {
+		uint32_t address = addr + offset;
+		int count = size - offset;
+
+		if (count > hex_record_size) {
+			count = hex_record_size;
+		}
+
+		if (is_erased(data + offset, count)) {
+			continue;
+		}
+
+		if ((int)(address >> 16) != high) {
+			uint8_t xaddr[2];
+
+			high = address >> 16;
+			xaddr[0] = high >> 8;
+			xaddr[1] = high & 0xff;
+			length += hex_line_overhead + 2 * sizeof(xaddr);
+			if (out) {
+				out = hex_record(out, 4, 0, xaddr, sizeof(xaddr));
+			}
+		}
+
+		length += hex_line_overhead + 2 * count;
+		if (out) {
+			out = hex_record(out, 0, address & 0xffff, data + offset, count);
+		}
+	}
+
+	length += hex_line_overhead;
+	if (out) {
+		hex_record(out, 1, 0, NULL, 0);
+	}
+
+	return length;
+}
+
+static err_t read_memory(ccd_ctx_t *ctx, dump_memory_t memory, uint32_t addr, void *data, int size)
+{
+	if (memory == dump_code) {
+		return ccd_read_code(ctx, addr, data, size);
+	}
+
+	return ccd_read_xdata(ctx, addr, data, size);
+}
+
+static err_t map_file(const char *file, size_t size, int *fd, void **map)
+{
+	err_t err = err_failed;
+
+	*map = MAP_FAILED;
+
+	*fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (*fd < 0) {
+		error_out("Can't open %s\n", file);
+	}
+
+	if (ftruncate(*fd, size)) {
+		error_out("Can't resize %s\n", file);
+	}
+
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (*map == MAP_FAILED) {
+		error_out("Can't map %s\n", file);
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+err_t dump_memory(ccd_ctx_t *ctx, dump_memory_t memory, uint32_t addr, int size, const char *file)
+{
+	err_t err = err_failed;
+	int hex = is_hex_file(file);
+	uint8_t *data = NULL;
+	void *map = MAP_FAILED;
+	size_t map_size = size;
+	int fd = -1;
+
+	log_print("[Dump] Dump %dB of %s at 0x%05x to %s\n",
+		size, memory == dump_code ? "flash" : "xdata", addr, file);
+
+	if (!hex) {
+		// Raw images are read from the target straight into the file
+		err = map_file(file, map_size, &fd, &map);
+		noerr_or_out(err);
+
+		err = read_memory(ctx, memory, addr, map, size);
+		noerr_or_out(err);
+
+		goto out;
+	}
+
+	data = malloc(size);
+	if (!data) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	err = read_memory(ctx, memory, addr, data, size);
+	noerr_or_out(err);
+
+	map_size = hex_format(NULL, addr, data, size);
+
+	err = map_file(file, map_size, &fd, &map);
+	noerr_or_out(err);
+
+	hex_format(map, addr, data, size);
+
+out:
+	if (map != MAP_FAILED) {
+		munmap(map, map_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(data);
+
+	return err;
+}
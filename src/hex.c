@@ -21,67 +21,102 @@
  * THE SOFTWARE.
  */
 
-#include <stdio.h>
-#include <strings.h>
-
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Building with -DHEX_SCALAR leaves the SSE2 decoder out, to compare
+#if defined(__SSE2__) && !defined(HEX_SCALAR)
+#define HEX_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "crc.h"
 #include "hex.h"
+#include "target.h"
 #include "tools.h"
 
-static int hexchars2int(const char *chars, int size)
-{
-	char *numberstr;
-	char *endptr;
-	int number;
-
-	numberstr = strndup((char *)chars, size);
-	number = strtol(numberstr, &endptr, 16);
-	free(numberstr);
-
-	return number;
-}
+/*
+ * Hex digit value with bit 4 set, zero for anything that isn't a digit.
+ * Both digits of a pair are valid if bit 4 survives and-ing their entries.
+ */
+static const uint8_t hex_digits[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
 
-static uint8_t checksum(const char *data, int size)
+/**
+ * Decode pairs of hex digits into bytes, adding them to the checksum.
+ * Returns 0 if a character isn't a hex digit.
+ */
+static int hex_decode(const char *chars, uint8_t *bytes, int size, uint8_t *sum)
 {
-	uint8_t sum = 0;
+	int i = 0;
+	uint8_t valid = 0x10;
+	uint8_t total = *sum;
+
+#ifdef HEX_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i invalid = zero;
+	__m128i sad = zero;
+
+	// 32 digits at a time: a whole record of the usual size
+	for (; i + 16 <= size; i += 16) {
+		__m128i nibbles[2];
+
+		for (int half = 0; half < 2; half++) {
+			__m128i c = _mm_loadu_si128((const __m128i *)(chars + 2 * i + 16 * half));
+			__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+			__m128i digit = _mm_and_si128(
+				_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+			__m128i alpha = _mm_and_si128(
+				_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+			invalid = _mm_or_si128(invalid, _mm_andnot_si128(_mm_or_si128(digit, alpha), _mm_set1_epi8(-1)));
+
+			nibbles[half] = _mm_or_si128(
+				_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+				_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+			// The first digit of a pair is the low byte of each 16-bit lane
+			nibbles[half] = _mm_or_si128(
+				_mm_slli_epi16(_mm_and_si128(nibbles[half], _mm_set1_epi16(0x00ff)), 4),
+				_mm_srli_epi16(nibbles[half], 8));
+		}
 
-	for (int i = 0; i < size; i++, data+=2) {
-		sum += hexchars2int(data, 2);
+		__m128i decoded = _mm_packus_epi16(nibbles[0], nibbles[1]);
+		_mm_storeu_si128((__m128i *)(bytes + i), decoded);
+		sad = _mm_add_epi64(sad, _mm_sad_epu8(decoded, zero));
 	}
 
-	sum ^= 0xff;
-	sum += 0x01;
+	if (_mm_movemask_epi8(invalid)) {
+		return 0;
+	}
 
-	return sum;
-}
+	total += _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sad, sad));
+#endif
 
-static char *get_hex_line(FILE *fp)
-{
-	char *line = NULL;
-	size_t size;
-	int nchars;
+	for (; i < size; i++) {
+		uint8_t high = hex_digits[(uint8_t)chars[2 * i]];
+		uint8_t low = hex_digits[(uint8_t)chars[2 * i + 1]];
 
-	nchars = getline(&line, &size, fp);
-	if (nchars < 0) {
-		line = NULL;
-		goto out;
+		valid &= high & low;
+		bytes[i] = high << 4 | (low & 0x0f);
+		total += bytes[i];
 	}
 
-	do {
-		char c = line[nchars-1];
-		if (c == '\r' || c == '\n') {
-			line[nchars-1] = '\0';
-			nchars--;
-		}
-		else {
-			break;
-		}
-	} while (nchars > 0);
+	*sum = total;
 
-out:
-	return line;
+	return valid != 0;
 }
 
-err_t hex_parse(ccd_ctx_t *ctx, FILE *fp)
+err_t hex_parse(hex_image_t *image, const char *text, size_t text_size)
 {
 	/* 
 	 *    HEX format
@@ -95,186 +130,600 @@ err_t hex_parse(ccd_ctx_t *ctx, FILE *fp)
 	 */
 
 	err_t err = err_failed;
-	char *line = NULL;
-	static uint8_t buffer[1 << 16];
-	uint16_t address_min = (1 << 16) - 1;
-	uint16_t address_max = 0;
+	const char *cur = text;
+	const char *end = text + text_size;
+	uint8_t *buffer = NULL;
+	uint32_t populated[TARGET_FLASH_MAX_SIZE / 4 / 32] = { 0 };
+	hex_segment_t *segments = NULL;
+	int nsegments = 0;
+	uint32_t address_base = 0;
 	const int min_hex_size = 11;
-	char *curchar = NULL;
-	int line_len = 0;
-	uint8_t bytecount = 0;
-	uint16_t address_low = 0;
-	uint16_t address_high = 0;
-	int block_size = 0;
-	enum {
-		state_getline,
-		state_colon,
-		state_bytecount,
-		state_address,
-		state_recordtype,
-		state_data,
-		state_xaddr,
-		state_checksum,
-		state_checksum_eof,
-		state_done,
-	} state;
-
-	state = state_getline;
-
-	while (state != state_done) {
-		uint8_t sum;
-
-		switch (state) {
-		case state_getline:
-			line = get_hex_line(fp);
-			if (!line) {
-				state = state_done;
+	int size = 0;
+
+	memset(image, 0, sizeof(*image));
+
+	buffer = malloc(TARGET_FLASH_MAX_SIZE);
+	if (!buffer) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	// Gaps between records are left erased
+	memset(buffer, 0xff, TARGET_FLASH_MAX_SIZE);
+
+	while (cur < end) {
+		const char *eol;
+		int line_len;
+		uint8_t header[4];
+		uint8_t sum = 0;
+		uint8_t check;
+		uint8_t bytecount;
+		uint32_t address;
+		uint8_t type;
+
+		if (*cur == '\r' || *cur == '\n') {
+			cur++;
+			continue;
+		}
+
+		eol = memchr(cur, '\n', end - cur);
+		if (!eol) {
+			eol = end;
+		}
+
+		line_len = eol - cur;
+		if (line_len && cur[line_len - 1] == '\r') {
+			line_len--;
+		}
+
+		if (line_len < min_hex_size) {
+			error_out("HEX line is too short\n");
+		}
+		if (*cur != ':') {
+			error_out("HEX line doesn't start with ':'\n");
+		}
+
+		if (!hex_decode(cur + 1, header, sizeof(header), &sum)) {
+			error_out("Bad HEX digit\n");
+		}
+
+		bytecount = header[0];
+		address = address_base + (header[1] << 8 | header[2]);
+		type = header[3];
+
+		if (bytecount * 2 + min_hex_size != line_len) {
+			error_out("Bad HEX byte count\n");
+		}
+
+		switch (type) {
+		case 0:
+			if (address + bytecount > TARGET_FLASH_MAX_SIZE) {
+				error_out("HEX data beyond flash at 0x%05x\n", address);
 			}
-			else {
-				line_len = strlen(line);
-				curchar = line;
-				state = state_colon;
+
+			// Data is decoded in place, a bad checksum fails the whole load
+			if (!hex_decode(cur + 9, buffer + address, bytecount, &sum)) {
+				error_out("Bad HEX digit\n");
 			}
-			break;
 
-		case state_colon:
-			if (line_len < min_hex_size) {
-				error_out("HEX line is too short\n");
+			// Flash is written by 4-byte words, an empty record populates none
+			for (uint32_t word = address / 4; bytecount && word < (address + bytecount + 3) / 4; word++) {
+				populated[word / 32] |= 1u << (word % 32);
 			}
-			if (*curchar != ':') {
-				error_out("HEX line doesn't start with ':'\n");
+			break;
+		case 1:
+			if (bytecount != 0) {
+				error_out("Bad HEX End Of File record\n");
 			}
-			curchar++;
-			state = state_bytecount;
 			break;
-
-		case state_bytecount:
-			bytecount = hexchars2int(curchar, 2);
-			if (bytecount * 2 + min_hex_size != line_len) {
-				error_out("Bad HEX byte count\n");
+		case 2:
+		case 4:
+			if (bytecount != 2) {
+				error_out("Bad HEX Extended Record\n");
+			}
+			if (!hex_decode(cur + 9, header, 2, &sum)) {
+				error_out("Bad HEX digit\n");
 			}
-			curchar += 2;
-			state = state_address;
+			// Segment base is in 16-byte paragraphs, linear base in 64 KB
+			address_base = (uint32_t)(header[0] << 8 | header[1]) << (type == 2 ? 4 : 16);
 			break;
-
-		case state_address:
-			address_low = hexchars2int(curchar, 4);
-			curchar += 4;
-			if (address_low < address_min) {
-				address_min = address_low;
+		case 3:
+		case 5:
+			// The entry point means nothing to the 8051, it starts at 0
+			if (bytecount != 4) {
+				error_out("Bad HEX Start Address Record\n");
 			}
-			if (address_low + bytecount > address_max) {
-				address_max = address_low + bytecount;
+			if (!hex_decode(cur + 9, header, 4, &sum)) {
+				error_out("Bad HEX digit\n");
 			}
-			state = state_recordtype;
 			break;
+		default:
+			error_out("Unknown HEX Record type\n");
+		}
 
-		case state_recordtype:
-			switch (hexchars2int(curchar, 2)) {
-			case 0:
-				state = state_data;
-				break;
-			case 1:
-				if (bytecount != 0) {
-					error_out("Bad HEX End Of File record\n");
-				}
-				state = state_checksum_eof;
-				break;
-			case 2:
-			case 3:
-				error_out("HEX Segment Address Record not supported\n");
-				break;
-			case 4:
-				state = state_xaddr;
-			case 5:
-				error_out("HEX Start Linear Address Record not supported\n");
-				break;
-			default:
-				error_out("Unknown HEX Record type\n");
-			}
-			curchar += 2;
+		if (!hex_decode(cur + line_len - 2, &check, 1, &sum)) {
+			error_out("Bad HEX digit\n");
+		}
+		if (sum != 0) {
+			error_out("HEX checksum doesn't match\n");
+		}
+
+		// Anything after the end of file record is ignored
+		if (type == 1) {
 			break;
+		}
 
-		case state_data:
-			if (address_high != 0) {
-				error_out("Extended Linear Address not supported\n");
-			}
+		cur = eol;
+	}
 
-			for (int i = 0; i < bytecount; i++) {
-				uint8_t byte = hexchars2int(curchar, 2);
-				curchar += 2;
-				buffer[address_low] = byte;
-				address_low++;
+	// Runs of populated words become segments
+	for (uint32_t word = 0; word < TARGET_FLASH_MAX_SIZE / 4; word++) {
+		int set = populated[word / 32] >> (word % 32) & 1;
+		int last_set = word && (populated[(word - 1) / 32] >> ((word - 1) % 32) & 1);
+
+		if (set && !last_set) {
+			hex_segment_t *grown = realloc(segments, (nsegments + 1) * sizeof(*segments));
+			if (!grown) {
+				err = err_oom;
+				error_out("Can't allocate memory\n");
 			}
+			segments = grown;
+			segments[nsegments].addr = word * 4;
+			segments[nsegments].size = 0;
+			segments[nsegments].data = buffer + word * 4;
+			nsegments++;
+		}
+		if (set) {
+			segments[nsegments - 1].size += 4;
+			size += 4;
+		}
+	}
 
-			state = state_checksum;
-			break;
+	if (nsegments == 0) {
+		error_out("HEX file has no data\n");
+	}
 
-		case state_xaddr:
-			if (bytecount != 2) {
-				error_out("Bad HEX Extended Record\n");
-			}
-			address_high = hexchars2int(curchar, 4);
-			curchar += 4;
-			state = state_checksum;
-			break;
+	for (int i = 0; i < nsegments; i++) {
+		log_print("[HEX] Segment of %dB at 0x%05x\n", segments[i].size, segments[i].addr);
+	}
+	log_print("[HEX] Found %dB of code in %d segment%s\n", size, nsegments, nsegments > 1 ? "s" : "");
 
-		case state_checksum:
-		case state_checksum_eof:
-			sum = checksum(line + 1, (line_len - 3) / 2);
-			if (sum != hexchars2int(curchar, 2)) {
-				error_out("HEX checksum doesn't match\n");
-			}
-			free(line);
-			line = NULL;
-			
-			if (state == state_checksum_eof) {
-				state = state_done;
-			}
-			else {
-				state = state_getline;
-			}
-			break;
+	for (int page = 0; page < TARGET_FLASH_PAGES; page++) {
+		const uint8_t *page_data = buffer + page * TARGET_FLASH_PAGE_SIZE;
+
+		image->page_crcs[page] = compute_crc16(page_data, TARGET_FLASH_PAGE_SIZE, 0xffff);
+	}
+
+	image->buffer = buffer;
+	image->segments = segments;
+	image->nsegments = nsegments;
+	buffer = NULL;
+	segments = NULL;
+
+	err = err_none;
 
-		case state_done:
+out:
+	free(buffer);
+	free(segments);
+
+	return err;
+}
+
+/**
+ * Index past the last segment sharing a flash page with segment i.
+ * The end address of that run is returned in *end.
+ */
+static int run_end(const hex_image_t *image, int i, uint32_t *end)
+{
+	*end = image->segments[i].addr + image->segments[i].size;
+
+	for (i++; i < image->nsegments; i++) {
+		const hex_segment_t *next = &image->segments[i];
+
+		if (next->addr / TARGET_FLASH_PAGE_SIZE != (*end - 1) / TARGET_FLASH_PAGE_SIZE) {
 			break;
+		}
+		*end = next->addr + next->size;
+	}
 
-		default:
-			error_out("HEX parsing failed\n");
+	return i;
+}
+
+static uint64_t hash_mix(uint64_t hash, uint64_t word)
+{
+	hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+	return hash ^ hash >> 32;
+}
+
+static uint64_t hash64(const uint8_t *data, size_t size)
+{
+	uint64_t lanes[4] = { 0x9e3779b97f4a7c15ull ^ size, 1, 2, 3 };
+	uint64_t word;
+	uint64_t hash;
+
+	// Four independent chains keep the multiplier busy
+	for (; size >= 32; data += 32, size -= 32) {
+		for (int i = 0; i < 4; i++) {
+			memcpy(&word, data + 8 * i, 8);
+			lanes[i] = hash_mix(lanes[i], word);
 		}
 	}
 
-	log_print("[HEX] Found %dB of code starting at 0x%04x\n", address_max - address_min, address_min);
+	hash = hash_mix(hash_mix(hash_mix(lanes[0], lanes[1]), lanes[2]), lanes[3]);
 
-	block_size = address_max - address_min;
-	block_size += (block_size % 4) ? 4 - block_size % 4 : 0;
-	err = ccd_write_code(ctx, address_min, buffer, block_size);
-	noerr_or_out(err);
+	for (; size >= 8; data += 8, size -= 8) {
+		memcpy(&word, data, 8);
+		hash = hash_mix(hash, word);
+	}
 
-out:
-	if (line) {
-		free(line);
+	word = 0;
+	memcpy(&word, data, size);
+
+	return hash_mix(hash, word);
+}
+
+/*
+ * Cache layout: header, segment table, then the data of each run of
+ * segments sharing pages, gaps included. Integers are in host order,
+ * the cache is only meant for the machine that wrote it.
+ */
+static const char cache_magic[8] = "CCDHEX\r\n";
+
+enum {
+	cache_version = 3,
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsegments;
+	uint64_t source_size;
+	uint64_t source_hash;
+	uint64_t body_hash;
+	uint16_t page_crcs[TARGET_FLASH_PAGES];
+} cache_header_t;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+	uint32_t offset;
+} cache_segment_t;
+
+static err_t cache_load(hex_image_t *image, const char *path, uint64_t source_size, uint64_t source_hash)
+{
+	err_t err = err_failed;
+	int fd = -1;
+	struct stat st;
+	uint8_t *map = MAP_FAILED;
+	const cache_header_t *header;
+	const cache_segment_t *table;
+	const uint8_t *data;
+	size_t data_size;
+	hex_segment_t *segments = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto out;
+	}
+
+	header = (const cache_header_t *)map;
+	if (memcmp(header->magic, cache_magic, sizeof(cache_magic)) ||
+		header->version != cache_version ||
+		header->source_size != source_size ||
+		header->source_hash != source_hash) {
+		log_print("[HEX] Cache %s is stale\n", path);
+		goto out;
+	}
+
+	if (header->nsegments == 0 || header->nsegments > TARGET_FLASH_MAX_SIZE / 4 ||
+		sizeof(*header) + header->nsegments * sizeof(*table) > (size_t)st.st_size ||
+		hash64(map + sizeof(*header), st.st_size - sizeof(*header)) != header->body_hash) {
+		log_print("[HEX] Cache %s is corrupted\n", path);
+		goto out;
+	}
+
+	table = (const cache_segment_t *)(map + sizeof(*header));
+	data = (const uint8_t *)(table + header->nsegments);
+	data_size = st.st_size - (data - map);
+
+	segments = malloc(header->nsegments * sizeof(*segments));
+	if (!segments) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	for (uint32_t i = 0; i < header->nsegments; i++) {
+		if (table[i].offset > data_size || table[i].size > data_size - table[i].offset ||
+			table[i].addr > TARGET_FLASH_MAX_SIZE || table[i].size > TARGET_FLASH_MAX_SIZE - table[i].addr) {
+			log_print("[HEX] Cache %s is corrupted\n", path);
+			goto out;
+		}
+
+		segments[i].addr = table[i].addr;
+		segments[i].size = table[i].size;
+		segments[i].data = data + table[i].offset;
 	}
 
+	memcpy(image->page_crcs, header->page_crcs, sizeof(image->page_crcs));
+	image->segments = segments;
+	image->nsegments = header->nsegments;
+	image->map = map;
+	image->map_size = st.st_size;
+	segments = NULL;
+	map = MAP_FAILED;
+
+	err = err_none;
+
+out:
+	free(segments);
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
 	return err;
 }
 
-err_t hex_flash(ccd_ctx_t *ctx, const char *file)
+static err_t cache_store(const hex_image_t *image, const char *path, uint64_t source_size, uint64_t source_hash)
 {
 	err_t err = err_failed;
+	cache_header_t header;
+	cache_segment_t *table = NULL;
+	uint8_t *body = NULL;
+	size_t table_size = image->nsegments * sizeof(*table);
+	size_t data_size = 0;
+	char *tmp_path = NULL;
 	FILE *fp = NULL;
 
-	fp = fopen(file, "r");
+	for (int i = 0; i < image->nsegments; ) {
+		uint32_t end;
+		uint32_t start = image->segments[i].addr;
+
+		i = run_end(image, i, &end);
+		data_size += end - start;
+	}
+
+	body = malloc(table_size + data_size);
+	tmp_path = malloc(strlen(path) + 16);
+	if (!body || !tmp_path) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	table = (cache_segment_t *)body;
+	data_size = 0;
+
+	for (int i = 0; i < image->nsegments; ) {
+		const hex_segment_t *first = &image->segments[i];
+		uint32_t end;
+		int next = run_end(image, i, &end);
+
+		for (; i < next; i++) {
+			table[i].addr = image->segments[i].addr;
+			table[i].size = image->segments[i].size;
+			table[i].offset = data_size + image->segments[i].addr - first->addr;
+		}
+
+		memcpy(body + table_size + data_size, first->data, end - first->addr);
+		data_size += end - first->addr;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.version = cache_version;
+	header.nsegments = image->nsegments;
+	header.source_size = source_size;
+	header.source_hash = source_hash;
+	header.body_hash = hash64(body, table_size + data_size);
+	memcpy(header.page_crcs, image->page_crcs, sizeof(header.page_crcs));
+
+	// Written aside and renamed, a concurrent load never sees half a cache
+	sprintf(tmp_path, "%s.%d", path, (int)getpid());
+
+	fp = fopen(tmp_path, "wb");
 	if (!fp) {
-		error_out("Can't open %s\n", file);
+		log_print("[HEX] Can't create cache %s\n", tmp_path);
+		goto out;
 	}
 
-	err = hex_parse(ctx, fp);
-	noerr_or_out(err);
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+		fwrite(body, table_size + data_size, 1, fp) != 1) {
+		log_print("[HEX] Can't write cache %s\n", tmp_path);
+		goto out;
+	}
+
+	if (fclose(fp)) {
+		fp = NULL;
+		log_print("[HEX] Can't write cache %s\n", tmp_path);
+		goto out;
+	}
+	fp = NULL;
+
+	if (rename(tmp_path, path)) {
+		log_print("[HEX] Can't rename cache to %s\n", path);
+		goto out;
+	}
+
+	log_print("[HEX] Cached image in %s\n", path);
+
+	err = err_none;
 
 out:
 	if (fp) {
 		fclose(fp);
 	}
+	if (err && tmp_path) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	free(body);
 	return err;
 }
+
+err_t hex_load(hex_image_t *image, const char *file)
+{
+	err_t err = err_failed;
+	int fd = -1;
+	struct stat st;
+	void *map = MAP_FAILED;
+	char *cache_path = NULL;
+	uint64_t hash;
+
+	memset(image, 0, sizeof(*image));
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		error_out("Can't open %s\n", file);
+	}
+
+	if (fstat(fd, &st) < 0) {
+		error_out("Can't stat %s\n", file);
+	}
+
+	if (st.st_size == 0) {
+		error_out("HEX file has no data\n");
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		error_out("Can't map %s\n", file);
+	}
+
+	cache_path = malloc(strlen(file) + sizeof(".cache"));
+	if (!cache_path) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+	sprintf(cache_path, "%s.cache", file);
+
+	hash = hash64(map, st.st_size);
+
+	if (cache_load(image, cache_path, st.st_size, hash) == err_none) {
+		log_print("[HEX] Loaded %d segment%s from %s\n",
+			image->nsegments, image->nsegments > 1 ? "s" : "", cache_path);
+		err = err_none;
+		goto out;
+	}
+
+	err = hex_parse(image, map, st.st_size);
+	noerr_or_out(err);
+
+	// Not being able to cache isn't an error
+	cache_store(image, cache_path, st.st_size, hash);
+
+out:
+	free(cache_path);
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return err;
+}
+
+void hex_free(hex_image_t *image)
+{
+	free(image->buffer);
+	free(image->segments);
+	if (image->map) {
+		munmap(image->map, image->map_size);
+	}
+	image->buffer = NULL;
+	image->segments = NULL;
+	image->nsegments = 0;
+	image->map = NULL;
+}
+
+err_t hex_write(ccd_ctx_t *ctx, const hex_image_t *image, ccd_write_mode_t mode)
+{
+	err_t err = err_none;
+
+	/*
+	 * A page is erased and checked as a whole, segments sharing one are
+	 * written together. The gap between them is erased, writing it leaves
+	 * the flash untouched.
+	 */
+	for (int i = 0; i < image->nsegments; ) {
+		const hex_segment_t *first = &image->segments[i];
+		uint32_t end;
+
+		i = run_end(image, i, &end);
+
+		err = ccd_write_code_crcs(ctx, first->addr, first->data, end - first->addr, mode, image->page_crcs);
+		noerr_or_out(err);
+	}
+
+out:
+	return err;
+}
+
+err_t hex_verify(ccd_ctx_t *ctx, const hex_image_t *image)
+{
+	err_t err = err_none;
+
+	for (int i = 0; i < image->nsegments; ) {
+		const hex_segment_t *first = &image->segments[i];
+		uint32_t end;
+
+		i = run_end(image, i, &end);
+
+		err = target_verify_flash(ctx, first->addr, first->data, end - first->addr);
+		noerr_or_out(err);
+	}
+
+out:
+	return err;
+}
+
+struct ccd_image_t {
+	hex_image_t hex;
+};
+
+err_t ccd_image_load(const char *file, ccd_image_t **image)
+{
+	err_t err = err_oom;
+
+	*image = calloc(1, sizeof(**image));
+	if (!*image) {
+		error_out("Can't allocate memory\n");
+	}
+
+	err = hex_load(&(*image)->hex, file);
+	noerr_or_out(err);
+
+out:
+	if (err) {
+		ccd_image_free(*image);
+		*image = NULL;
+	}
+	return err;
+}
+
+void ccd_image_free(ccd_image_t *image)
+{
+	if (image) {
+		hex_free(&image->hex);
+		free(image);
+	}
+}
+
+err_t ccd_image_write(ccd_ctx_t *ctx, const ccd_image_t *image, ccd_write_mode_t mode)
+{
+	return hex_write(ctx, &image->hex, mode);
+}
+
+err_t ccd_image_verify(ccd_ctx_t *ctx, const ccd_image_t *image)
+{
+	return hex_verify(ctx, &image->hex);
+}
@@ -25,8 +25,56 @@
 #define HEX_H
 
 #include "ccd.h"
+#include "target.h"
 #include "tools.h"
 
-err_t hex_flash(ccd_ctx_t *ctx, const char *file);
+typedef struct {
+	uint32_t addr;
+	int size;
+	const uint8_t *data;
+} hex_segment_t;
+
+/**
+ * Populated ranges of the flash, sorted by address and aligned to
+ * 4-byte words. Segments sharing a flash page have their data laid out
+ * contiguously, the gaps between them erased.
+ * The data lives either in the parse buffer or in the mapped cache.
+ */
+typedef struct {
+	hex_segment_t *segments;
+	int nsegments;
+	uint8_t *buffer;
+	void *map;
+	size_t map_size;
+
+	// CRC16 of each flash page as the image leaves it
+	uint16_t page_crcs[TARGET_FLASH_PAGES];
+} hex_image_t;
+
+/**
+ * Load a HEX file into an image.
+ * The parsed image is cached next to the file (<file>.cache) and reused
+ * as long as the content of the file hashes the same.
+ * A loaded image is only read by hex_write(), so it can be shared by
+ * several contexts at once.
+ */
+err_t hex_load(hex_image_t *image, const char *file);
+
+/**
+ * Parse HEX text into an image, without going through the cache.
+ */
+err_t hex_parse(hex_image_t *image, const char *text, size_t text_size);
+void hex_free(hex_image_t *image);
+
+/**
+ * Write the segments of an image to flash and verify them.
+ * The mode tells which pages, if any, have to be erased first.
+ */
+err_t hex_write(ccd_ctx_t *ctx, const hex_image_t *image, ccd_write_mode_t mode);
+
+/**
+ * Check the segments of an image against the flash, without writing.
+ */
+err_t hex_verify(ccd_ctx_t *ctx, const hex_image_t *image);
 
 #endif
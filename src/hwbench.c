@@ -0,0 +1,310 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "hwbench.h"
+#include "target.h"
+#include "usb.h"
+
+enum {
+	hwbench_max_ops = 128,
+	// SRAM above what the flash path uses for buffers and descriptors
+	hwbench_xdata   = 0x1000,
+	hwbench_flash   = 64 * 1024,
+};
+
+typedef struct {
+	ccd_ctx_t *ctx;
+	uint8_t *data;
+	uint32_t addr;
+	int size;
+	uint16_t crcs[TARGET_FLASH_PAGES];
+} hwbench_t;
+
+typedef err_t (*hwbench_fn_t)(hwbench_t *bench);
+
+static uint64_t hwbench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int uint64_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Run a primitive a number of times, with a setup before each run that
+ * isn't timed, and report the spread of its duration. The rate is taken
+ * from the median run, a tired debugger shows in the spread.
+ */
+static err_t hwbench_case(hwbench_t *bench, FILE *fp, int *count, const char *name,
+	int ops, int bytes, hwbench_fn_t setup, hwbench_fn_t fn)
+{
+	err_t err = err_failed;
+	uint64_t times[hwbench_max_ops];
+	uint64_t median;
+
+	log_print("[Bench] %s, %d runs\n", name, ops);
+
+	for (int i = 0; i < ops; i++) {
+		uint64_t start;
+
+		if (setup) {
+			err = setup(bench);
+			noerr_or_out(err);
+		}
+
+		start = hwbench_now_ns();
+		err = fn(bench);
+		noerr_or_out(err);
+		times[i] = hwbench_now_ns() - start;
+	}
+
+	qsort(times, ops, sizeof(*times), uint64_compare);
+	median = times[ops / 2] ? times[ops / 2] : 1;
+
+	fprintf(fp, "%s    \"%s\": {\"ops\": %d, \"bytes\": %d, \"min_us\": %.1f, \"p50_us\": %.1f, \"max_us\": %.1f",
+		(*count)++ ? ",\n" : "",
+		name, ops, bytes,
+		times[0] / 1000.0,
+		times[ops / 2] / 1000.0,
+		times[ops - 1] / 1000.0);
+	if (bytes) {
+		fprintf(fp, ", \"kb_per_s\": %.1f", bytes * 1e9 / 1024 / median);
+	}
+	fprintf(fp, "}");
+
+out:
+	if (err) {
+		fprintf(stderr, "Benchmark %s failed\n", name);
+	}
+	return err;
+}
+
+static err_t bench_fw_info(hwbench_t *bench)
+{
+	ccd_fw_info_t info;
+
+	return ccd_fw_info(bench->ctx, &info);
+}
+
+static err_t bench_read_status(hwbench_t *bench)
+{
+	uint8_t status;
+
+	return target_read_status(bench->ctx, &status);
+}
+
+static err_t bench_read_config(hwbench_t *bench)
+{
+	uint8_t config;
+
+	return target_read_config(bench->ctx, &config);
+}
+
+static err_t bench_target_info(hwbench_t *bench)
+{
+	ccd_target_info_t info;
+
+	return ccd_target_info(bench->ctx, &info);
+}
+
+static err_t bench_read_xdata(hwbench_t *bench)
+{
+	return target_read_xdata(bench->ctx, bench->addr, bench->data, bench->size);
+}
+
+static err_t bench_write_xdata(hwbench_t *bench)
+{
+	return target_write_xdata(bench->ctx, bench->addr, bench->data, bench->size);
+}
+
+static err_t bench_read_code(hwbench_t *bench)
+{
+	return target_read_code(bench->ctx, bench->addr, bench->data, bench->size);
+}
+
+static err_t bench_erase(hwbench_t *bench)
+{
+	return ccd_erase(bench->ctx);
+}
+
+static err_t bench_erase_page(hwbench_t *bench)
+{
+	return target_erase_page(bench->ctx, bench->addr / TARGET_FLASH_PAGE_SIZE);
+}
+
+static err_t bench_write_flash(hwbench_t *bench)
+{
+	return target_write_flash(bench->ctx, bench->addr, bench->data, bench->size, 0);
+}
+
+static err_t bench_write_flash_verify(hwbench_t *bench)
+{
+	return target_write_flash(bench->ctx, bench->addr, bench->data, bench->size, TARGET_WRITE_VERIFY);
+}
+
+static err_t bench_verify_flash(hwbench_t *bench)
+{
+	return target_verify_flash(bench->ctx, bench->addr, bench->data, bench->size);
+}
+
+static err_t bench_page_crcs(hwbench_t *bench)
+{
+	return target_read_page_crcs(bench->ctx, bench->addr / TARGET_FLASH_PAGE_SIZE,
+		bench->size / TARGET_FLASH_PAGE_SIZE, bench->crcs);
+}
+
+static err_t bench_enter_debug_fast(hwbench_t *bench)
+{
+	return ccd_enter_debug(bench->ctx, 0);
+}
+
+static err_t bench_enter_debug_slow(hwbench_t *bench)
+{
+	return ccd_enter_debug(bench->ctx, 1);
+}
+
+static err_t hwbench_mode(hwbench_t *bench, FILE *fp, int slow_mode)
+{
+	err_t err = err_failed;
+	const int write_sizes[] = { 1024, 4096, 16384, hwbench_flash };
+	int count = 0;
+	char name[64];
+
+	fprintf(fp, "  \"%s\": {\n", slow_mode ? "slow" : "fast");
+
+	// Enter last, the speed mode sticks for everything that follows
+	err = hwbench_case(bench, fp, &count, "ccd_enter_debug", 8, 0, NULL,
+		slow_mode ? bench_enter_debug_slow : bench_enter_debug_fast);
+	noerr_or_out(err);
+
+	// Round trips
+	err = hwbench_case(bench, fp, &count, "usb.control", 100, 0, NULL, bench_fw_info);
+	noerr_or_out(err);
+	err = hwbench_case(bench, fp, &count, "target_read_status", 100, 1, NULL, bench_read_status);
+	noerr_or_out(err);
+	err = hwbench_case(bench, fp, &count, "target_read_config", 100, 1, NULL, bench_read_config);
+	noerr_or_out(err);
+	err = hwbench_case(bench, fp, &count, "ccd_target_info", 100, 4, NULL, bench_target_info);
+	noerr_or_out(err);
+
+	// xdata, instructions below the burst size and bursts above it
+	bench->addr = hwbench_xdata;
+	for (int size = 1; size <= 4096; size *= 8) {
+		bench->size = size;
+
+		snprintf(name, sizeof(name), "target_read_xdata.%d", size);
+		err = hwbench_case(bench, fp, &count, name, 20, size, NULL, bench_read_xdata);
+		noerr_or_out(err);
+
+		snprintf(name, sizeof(name), "target_write_xdata.%d", size);
+		err = hwbench_case(bench, fp, &count, name, 20, size, NULL, bench_write_xdata);
+		noerr_or_out(err);
+	}
+
+	// Flash, from the start of the erased part
+	bench->addr = 0;
+
+	err = hwbench_case(bench, fp, &count, "ccd_erase", 3, 0, NULL, bench_erase);
+	noerr_or_out(err);
+
+	bench->size = TARGET_FLASH_PAGE_SIZE;
+	err = hwbench_case(bench, fp, &count, "target_erase_page", 8, TARGET_FLASH_PAGE_SIZE, NULL, bench_erase_page);
+	noerr_or_out(err);
+
+	for (unsigned i = 0; i < sizeof(write_sizes) / sizeof(write_sizes[0]); i++) {
+		bench->size = write_sizes[i];
+
+		snprintf(name, sizeof(name), "target_write_flash.%d", bench->size);
+		err = hwbench_case(bench, fp, &count, name, 3, bench->size, bench_erase, bench_write_flash);
+		noerr_or_out(err);
+	}
+
+	bench->size = hwbench_flash;
+	err = hwbench_case(bench, fp, &count, "target_write_flash.verify", 3, bench->size, bench_erase, bench_write_flash_verify);
+	noerr_or_out(err);
+
+	// What was written last is left in place for the reads
+	err = hwbench_case(bench, fp, &count, "target_verify_flash", 5, bench->size, NULL, bench_verify_flash);
+	noerr_or_out(err);
+	err = hwbench_case(bench, fp, &count, "target_read_page_crcs", 5, bench->size, NULL, bench_page_crcs);
+	noerr_or_out(err);
+	err = hwbench_case(bench, fp, &count, "target_read_code", 3, bench->size, NULL, bench_read_code);
+	noerr_or_out(err);
+
+	err = ccd_erase(bench->ctx);
+	noerr_or_out(err);
+
+	fprintf(fp, "\n  }");
+
+out:
+	return err;
+}
+
+err_t hwbench_run(ccd_ctx_t *ctx, FILE *fp)
+{
+	err_t err = err_failed;
+	hwbench_t bench = { .ctx = ctx };
+	uint32_t state = 0x2541;
+
+	log_print("[Bench] Characterize debugger and target\n");
+
+	bench.data = malloc(hwbench_flash);
+	if (!bench.data) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	// Random data, so that next to no flash word is left erased
+	for (int i = 0; i < hwbench_flash; i++) {
+		state = state * 1103515245 + 12345;
+		bench.data[i] = state >> 16;
+	}
+
+	fprintf(fp, "{\n");
+
+	err = hwbench_mode(&bench, fp, 0);
+	noerr_or_out(err);
+
+	fprintf(fp, ",\n");
+
+	err = hwbench_mode(&bench, fp, 1);
+	noerr_or_out(err);
+
+	fprintf(fp, "\n}\n");
+
+out:
+	free(bench.data);
+	return err;
+}
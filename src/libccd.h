@@ -0,0 +1,130 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LIBCCD_H
+#define LIBCCD_H
+
+#include <stdint.h>
+
+/*
+ * Public interface of libccd, the library ccd is built on.
+ *
+ * Everything a debugger needs lives in its context: a context is used by
+ * one thread at a time, different contexts can be driven from different
+ * threads at once. Loaded images are read-only and can be shared by all
+ * of them. Logging and statistics are process wide and thread-safe.
+ */
+
+#define LIBCCD_VERSION_MAJOR 1
+#define LIBCCD_VERSION_MINOR 0
+
+#define CCD_API __attribute__((visibility("default")))
+
+typedef enum {
+	ccd_err_none   = 0,
+	ccd_err_failed = 1,
+	ccd_err_oom    = 2,
+} ccd_err_t;
+
+typedef enum {
+	ccd_log_off,
+	ccd_log_debug, // What every module does
+	ccd_log_trace, // Transfer contents as well
+} ccd_log_level_t;
+
+CCD_API void ccd_log_set(ccd_log_level_t level);
+
+// Wait for everything logged so far to be written
+CCD_API void ccd_log_flush(void);
+
+typedef struct ccd_ctx_t ccd_ctx_t;
+
+/**
+ * Where contexts get their debugger from, all zero for the USB devices.
+ * Only read while counting and opening.
+ */
+typedef struct {
+	const char *sim_options; // Simulated debugger and target, see README
+	const char *replay_file; // Trace served instead of a device
+	int replay_timing;       // Replay as slowly as the recorded session
+	const char *record_file; // Trace of every transfer, <file>.<n> past device 0
+} ccd_config_t;
+
+CCD_API int ccd_count(const ccd_config_t *config);
+CCD_API ccd_ctx_t *ccd_open(int index, const ccd_config_t *config);
+CCD_API void ccd_close(ccd_ctx_t *ctx);
+
+typedef struct __attribute__((packed)) {
+	uint16_t chip;
+	uint16_t fw_id;
+	uint16_t fw_rev;
+	uint16_t dontknow;
+} ccd_fw_info_t;
+
+typedef struct {
+	int chip_id;
+	int chip_version;
+	int flash_size;
+	int sram_size;
+} ccd_target_info_t;
+
+CCD_API ccd_err_t ccd_enter_debug(ccd_ctx_t *ctx, int slow_mode);
+CCD_API ccd_err_t ccd_leave_debug(ccd_ctx_t *ctx);
+
+/**
+ * Tell whether the target is still halted in the debug session entered
+ * earlier. It isn't anymore once it was reset, power cycled or replaced.
+ */
+CCD_API ccd_err_t ccd_check_debug(ccd_ctx_t *ctx, int *in_debug);
+
+CCD_API ccd_err_t ccd_fw_info(ccd_ctx_t *ctx, ccd_fw_info_t *info);
+CCD_API ccd_err_t ccd_target_info(ccd_ctx_t *ctx, ccd_target_info_t *info);
+CCD_API ccd_err_t ccd_reset(ccd_ctx_t *ctx);
+CCD_API ccd_err_t ccd_erase(ccd_ctx_t *ctx);
+CCD_API ccd_err_t ccd_erase_pages(ccd_ctx_t *ctx, int first_page, int count);
+
+CCD_API ccd_err_t ccd_read_xdata(ccd_ctx_t *ctx, uint16_t addr, void *data, int size);
+CCD_API ccd_err_t ccd_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const void *data, int size);
+CCD_API ccd_err_t ccd_read_code(ccd_ctx_t *ctx, uint32_t addr, void *data, int size);
+
+typedef enum {
+	ccd_write_erased, // Flash is already erased
+	ccd_write_pages,  // Erase the pages covered by the code
+	ccd_write_diff,   // Only erase and rewrite the pages that differ
+} ccd_write_mode_t;
+
+CCD_API ccd_err_t ccd_write_code(ccd_ctx_t *ctx, uint32_t addr, const void *data, int size, ccd_write_mode_t mode);
+
+/**
+ * A HEX file parsed once, to be written to any number of targets.
+ */
+typedef struct ccd_image_t ccd_image_t;
+
+CCD_API ccd_err_t ccd_image_load(const char *file, ccd_image_t **image);
+CCD_API void ccd_image_free(ccd_image_t *image);
+
+// Write the image to flash and verify it
+CCD_API ccd_err_t ccd_image_write(ccd_ctx_t *ctx, const ccd_image_t *image, ccd_write_mode_t mode);
+CCD_API ccd_err_t ccd_image_verify(ccd_ctx_t *ctx, const ccd_image_t *image);
+
+#endif
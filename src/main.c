@@ -22,20 +22,39 @@
  */
 
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <strings.h>
 
 #include "tools.h"
 #include "ccd.h"
+#include "daemon.h"
 #include "hex.h"
+#include "dump.h"
+#include "hwbench.h"
+#include "stats.h"
 
 typedef struct {
 	int verbose;
 	int info;
 	int erase;
 	int slow;
+	int diff;
+	int pages;
+	int gang;
 	char *hex_file;
+	char *verify_file;
+	char *dump_file;
+	char *dump_xdata_file;
+	int stats;
+	char *stats_file;
+	ccd_config_t config;
+	int bench;
+	char *bench_file;
+	char *daemon_socket;
+	char *connect_socket;
 } options_t;
 
 static err_t parse_options(options_t *options, int argc, char * const *argv)
@@ -50,6 +69,20 @@ static err_t parse_options(options_t *options, int argc, char * const *argv)
 		{"erase",   no_argument,       0, 'e'},
 		{"hex",     required_argument, 0, 'x'},
 		{"slow",    required_argument, 0, 's'},
+		{"diff",    no_argument,       0, 'd'},
+		{"pages",   no_argument,       0, 'p'},
+		{"gang",    no_argument,       0, 'g'},
+		{"dump",    required_argument, 0, 'r'},
+		{"dump-xdata", required_argument, 0, 'R'},
+		{"stats",   optional_argument, 0, 'S'},
+		{"record",  required_argument, 0, 'T'},
+		{"replay",  required_argument, 0, 'P'},
+		{"replay-timing", no_argument, 0, 'M'},
+		{"sim",     optional_argument, 0, 'I'},
+		{"bench",   optional_argument, 0, 'B'},
+		{"verify",  required_argument, 0, 'V'},
+		{"daemon",  required_argument, 0, 'D'},
+		{"connect", required_argument, 0, 'C'},
 		{0, 0, 0, 0}
 	};
 
@@ -57,7 +90,7 @@ static err_t parse_options(options_t *options, int argc, char * const *argv)
 
 	while (1) {
 		int option_index = 0;
-		int c = getopt_long(argc, argv, "hviesx:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "hviesdpgx:r:R:", long_options, &option_index);
 
 		if (c == -1) {
 			break;
@@ -66,7 +99,7 @@ static err_t parse_options(options_t *options, int argc, char * const *argv)
 		switch (c)
 		{
 			case 'v':
-				options->verbose = 1;
+				options->verbose++;
 				break;
 			case 'i':
 				options->info = 1;
@@ -81,6 +114,50 @@ static err_t parse_options(options_t *options, int argc, char * const *argv)
 			case 's':
 				options->slow = 1;
 				break;
+			case 'd':
+				options->diff = 1;
+				break;
+			case 'p':
+				options->pages = 1;
+				break;
+			case 'g':
+				options->gang = 1;
+				break;
+			case 'r':
+				options->dump_file = optarg;
+				break;
+			case 'R':
+				options->dump_xdata_file = optarg;
+				break;
+			case 'S':
+				options->stats = 1;
+				options->stats_file = optarg;
+				break;
+			case 'T':
+				options->config.record_file = optarg;
+				break;
+			case 'P':
+				options->config.replay_file = optarg;
+				break;
+			case 'M':
+				options->config.replay_timing = 1;
+				break;
+			case 'I':
+				options->config.sim_options = optarg ? optarg : "";
+				break;
+			case 'B':
+				options->bench = 1;
+				options->bench_file = optarg;
+				break;
+			case 'V':
+				options->verify_file = optarg;
+				break;
+			case 'D':
+				options->daemon_socket = optarg;
+				break;
+			case 'C':
+				options->connect_socket = optarg;
+				break;
 			case '?':
 				err = 1;
 				break;
@@ -94,35 +171,67 @@ static err_t parse_options(options_t *options, int argc, char * const *argv)
 		printf("Usage: %s [options]\n", argv[0]);
 		printf("Options:\n");
 		printf("  -h, --help           \tPrint this help\n");
-		printf("  -v, --verbose        \tVerbose mode\n");
+		printf("  -v, --verbose        \tVerbose mode, twice to dump transfers\n");
 		printf("  -i, --info           \tPrint target info\n");
 		printf("  -e, --erase          \tErase flash\n");
 		printf("  -x, --hex <filename> \tErase, Write HEX file to flash, Verify\n");
 		printf("  -s, --slow           \tSlow mode\n");
+		printf("  -d, --diff           \tWith --hex, only rewrite the pages that differ\n");
+		printf("  -p, --pages          \tWith --hex, only erase the pages the file covers\n");
+		printf("  -g, --gang           \tRun on every connected CC-Debugger in parallel\n");
+		printf("  -r, --dump <filename>\tRead flash to a file (.hex for Intel HEX)\n");
+		printf("  -R, --dump-xdata <filename>\tRead SRAM to a file (.hex for Intel HEX)\n");
+		printf("      --stats[=<filename>]\tPrint USB and timing statistics as JSON at exit\n");
+		printf("      --record <filename>\tRecord every USB transfer to a trace file\n");
+		printf("      --replay <filename>\tServe USB transfers from a trace instead of a device\n");
+		printf("      --replay-timing  \tWith --replay, take as long as the recorded session\n");
+		printf("      --sim[=<options>]\tUse a simulated CC-Debugger and CC2541 (see README)\n");
+		printf("      --bench[=<filename>]\tTime the debugger and target primitives, erases the flash\n");
+		printf("      --verify <filename>\tVerify flash against a HEX file\n");
+		printf("      --daemon <socket>\tKeep the debugger in debug mode and serve jobs on a socket\n");
+		printf("      --connect <socket>\tRun the jobs on a daemon instead of a local debugger\n");
+
+		err = err_failed;
+	}
 
+	if (options->bench && options->gang) {
+		fprintf(stderr, "Benchmarking works on a single debugger\n");
 		err = err_failed;
 	}
 
+	if (options->daemon_socket && (options->gang || options->bench || options->connect_socket ||
+		options->info || options->erase || options->hex_file || options->verify_file ||
+		options->dump_file || options->dump_xdata_file)) {
+		fprintf(stderr, "The daemon takes its jobs from --connect\n");
+		err = err_failed;
+	}
+
+	if (options->connect_socket && (options->gang || options->bench)) {
+		fprintf(stderr, "Jobs sent to a daemon run on its debugger\n");
+		err = err_failed;
+	}
+
+	// Differential and page writes erase the pages they need themselves
+	if ((options->diff || options->pages) && options->hex_file) {
+		options->erase = 0;
+	}
+
 	return err;
 }
 
-int main(int argc, char * const *argv)
+static err_t run(const options_t *options, const hex_image_t *image, const hex_image_t *verify_image, int index)
 {
-	err_t err;
+	err_t err = err_failed;
 	ccd_ctx_t *ctx = NULL;
 	ccd_fw_info_t fw_info;
-	options_t options;
+	char prefix[16] = "";
 
-	err = parse_options(&options, argc, argv);
-	if (err) {
-		goto out_parse;
+	// Lines of concurrent gang workers are told apart by device index
+	if (options->gang) {
+		snprintf(prefix, sizeof(prefix), "[%d] ", index);
 	}
 
-	if (options.verbose) {
-		log_set(1);
-	}
-
-	ctx = ccd_open();
+	ctx = ccd_open(index, &options->config);
 	if (!ctx) {
 		goto out;
 	}
@@ -130,42 +239,98 @@ int main(int argc, char * const *argv)
 	err = ccd_fw_info(ctx, &fw_info);
 	noerr_or_out(err);
 
-	printf("CC-Debugger: FW 0x%04x rev 0x%04x\n", fw_info.fw_id, fw_info.fw_rev);
+	printf("%sCC-Debugger: FW 0x%04x rev 0x%04x\n", prefix, fw_info.fw_id, fw_info.fw_rev);
 
 	if (fw_info.chip == 0) {
-		error_out("No target found\n");
+		err = err_failed;
+		error_out("%sNo target found\n", prefix);
 	}
 
-	printf("Target: CC%x\n", fw_info.chip);
+	printf("%sTarget: CC%x\n", prefix, fw_info.chip);
 
-	err = ccd_enter_debug(ctx, options.slow);
+	err = ccd_enter_debug(ctx, options->slow);
 	noerr_or_out(err);
 
-	if (options.info) {
+	if (options->info) {
 		ccd_target_info_t target_info;
 		err = ccd_target_info(ctx, &target_info);
 		noerr_or_out(err);
 
-		printf(" Chip ID: 0x%x\n", target_info.chip_id);
-		printf(" Chip version: %d\n", target_info.chip_version);
-		printf(" Flash size: %d KB\n", target_info.flash_size);
-		printf(" SRAM size: %d KB\n", target_info.sram_size);
+		printf("%s Chip ID: 0x%x\n", prefix, target_info.chip_id);
+		printf("%s Chip version: %d\n", prefix, target_info.chip_version);
+		printf("%s Flash size: %d KB\n", prefix, target_info.flash_size);
+		printf("%s SRAM size: %d KB\n", prefix, target_info.sram_size);
 	}
 
-	if (options.erase) {
-		printf("Erasing flash...\n");
+	if (options->bench) {
+		FILE *fp = stdout;
+
+		printf("%sBenchmarking...\n", prefix);
+
+		if (options->bench_file) {
+			fp = fopen(options->bench_file, "w");
+			if (!fp) {
+				err = err_failed;
+				error_out("Can't open %s\n", options->bench_file);
+			}
+		}
+
+		err = hwbench_run(ctx, fp);
+
+		if (fp != stdout) {
+			fclose(fp);
+		}
+		noerr_or_out(err);
+	}
+
+	if (options->erase) {
+		printf("%sErasing flash...\n", prefix);
 		err = ccd_erase(ctx);
 		noerr_or_out(err);
 	}
 
-	if (options.hex_file) {
-		printf("Writing HEX to flash...\n");
-		err = hex_flash(ctx, options.hex_file);
+	if (options->hex_file) {
+		ccd_write_mode_t mode = ccd_write_erased;
+
+		if (options->diff) {
+			mode = ccd_write_diff;
+		}
+		else if (options->pages) {
+			mode = ccd_write_pages;
+		}
+
+		printf("%sWriting HEX to flash...\n", prefix);
+		err = hex_write(ctx, image, mode);
 		noerr_or_out(err);
 	}
 
-	if (options.erase || options.hex_file) {
-		printf("Done.\n");
+	if (options->verify_file) {
+		printf("%sVerifying flash...\n", prefix);
+		err = hex_verify(ctx, verify_image);
+		noerr_or_out(err);
+	}
+
+	if (options->dump_file || options->dump_xdata_file) {
+		ccd_target_info_t target_info;
+		err = ccd_target_info(ctx, &target_info);
+		noerr_or_out(err);
+
+		if (options->dump_file) {
+			printf("%sDumping flash...\n", prefix);
+			err = dump_memory(ctx, dump_code, 0, target_info.flash_size * 1024, options->dump_file);
+			noerr_or_out(err);
+		}
+
+		if (options->dump_xdata_file) {
+			printf("%sDumping SRAM...\n", prefix);
+			err = dump_memory(ctx, dump_xdata, 0, target_info.sram_size * 1024, options->dump_xdata_file);
+			noerr_or_out(err);
+		}
+	}
+
+	if (options->bench || options->erase || options->hex_file || options->verify_file ||
+		options->dump_file || options->dump_xdata_file) {
+		printf("%sDone.\n", prefix);
 	}
 
 	err = ccd_leave_debug(ctx);
@@ -173,6 +338,236 @@ int main(int argc, char * const *argv)
 
 out:
 	ccd_close(ctx);
+	return err;
+}
+
+typedef struct {
+	const options_t *options;
+	const hex_image_t *image;
+	const hex_image_t *verify_image;
+	int index;
+	pthread_t thread;
+	err_t err;
+} worker_t;
+
+static void *run_worker(void *arg)
+{
+	worker_t *worker = arg;
+
+	worker->err = run(worker->options, worker->image, worker->verify_image, worker->index);
+
+	return NULL;
+}
+
+static err_t run_gang(const options_t *options, const hex_image_t *image, const hex_image_t *verify_image)
+{
+	err_t err = err_failed;
+	worker_t *workers = NULL;
+	int count;
+	int started = 0;
+	int failed = 0;
+
+	count = ccd_count(&options->config);
+	if (count <= 0) {
+		error_out("Can't find device\n");
+	}
+
+	printf("Found %d CC-Debugger%s\n", count, count > 1 ? "s" : "");
+
+	workers = calloc(count, sizeof(*workers));
+	if (!workers) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	// Every worker drives its own debugger, the image is shared read-only
+	for (started = 0; started < count; started++) {
+		workers[started].options = options;
+		workers[started].image = image;
+		workers[started].verify_image = verify_image;
+		workers[started].index = started;
+
+		if (pthread_create(&workers[started].thread, NULL, run_worker, &workers[started])) {
+			error_out("Can't start worker %d\n", started);
+		}
+	}
+
+	err = err_none;
+
+out:
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < started; i++) {
+		printf("Debugger %d: %s\n", i, workers[i].err ? "FAIL" : "PASS");
+		failed += workers[i].err != err_none;
+	}
+
+	if (failed) {
+		printf("%d of %d failed\n", failed, count);
+		err = err_failed;
+	}
+
+	free(workers);
+	return err;
+}
+
+typedef enum {
+	job_input,
+	job_output,
+} job_file_t;
+
+/*
+ * Files are opened by the daemon, from its own working directory. They are
+ * sent as absolute paths: inputs must exist here, outputs are taken from
+ * the current directory.
+ */
+static err_t add_job(FILE *fp, const char *job, const char *file, job_file_t type)
+{
+	err_t err = err_failed;
+	char path[PATH_MAX];
+	char cwd[PATH_MAX];
+
+	if (!file) {
+		fprintf(fp, "%s\n", job);
+	}
+	else if (type == job_input) {
+		if (!realpath(file, path)) {
+			error_out("Can't find %s\n", file);
+		}
+		fprintf(fp, "%s %s\n", job, path);
+	}
+	else if (file[0] == '/') {
+		fprintf(fp, "%s %s\n", job, file);
+	}
+	else {
+		if (!getcwd(cwd, sizeof(cwd))) {
+			error_out("Can't get the current directory\n");
+		}
+		fprintf(fp, "%s %s/%s\n", job, cwd, file);
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t run_remote(const options_t *options)
+{
+	err_t err = err_failed;
+	char *jobs = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&jobs, &size);
+	if (!fp) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
+	}
+
+	err = err_none;
+
+	if (options->info) {
+		err = add_job(fp, "info", NULL, job_input);
+	}
+	if (!err && options->erase) {
+		err = add_job(fp, "erase", NULL, job_input);
+	}
+	if (!err && options->hex_file) {
+		err = add_job(fp, options->diff ? "hex diff" : options->pages ? "hex pages" : "hex erased",
+			options->hex_file, job_input);
+	}
+	if (!err && options->verify_file) {
+		err = add_job(fp, "verify", options->verify_file, job_input);
+	}
+	if (!err && options->dump_file) {
+		err = add_job(fp, "dump", options->dump_file, job_output);
+	}
+	if (!err && options->dump_xdata_file) {
+		err = add_job(fp, "dump-xdata", options->dump_xdata_file, job_output);
+	}
+
+	fclose(fp);
+	noerr_or_out(err);
+
+	err = daemon_submit(options->connect_socket, jobs);
+	noerr_or_out(err);
+
+out:
+	free(jobs);
+	return err;
+}
+
+int main(int argc, char * const *argv)
+{
+	err_t err;
+	options_t options;
+	hex_image_t image = { .buffer = NULL };
+	hex_image_t verify_image = { .buffer = NULL };
+
+	err = parse_options(&options, argc, argv);
+	if (err) {
+		goto out_parse;
+	}
+
+	if (options.verbose) {
+		log_set(options.verbose > 1 ? log_trace : log_debug);
+	}
+
+	if (options.stats) {
+		stats_enable();
+	}
+
+	if (options.daemon_socket) {
+		err = daemon_serve(options.daemon_socket, &options.config, options.slow);
+		goto out;
+	}
+
+	if (options.connect_socket) {
+		err = run_remote(&options);
+		goto out;
+	}
+
+	// Parse once, before anything is erased
+	if (options.hex_file) {
+		err = hex_load(&image, options.hex_file);
+		noerr_or_out(err);
+	}
+	if (options.verify_file) {
+		err = hex_load(&verify_image, options.verify_file);
+		noerr_or_out(err);
+	}
+
+	if (options.gang) {
+		err = run_gang(&options, &image, &verify_image);
+	}
+	else {
+		err = run(&options, &image, &verify_image, 0);
+	}
+
+out:
+	if (options.stats) {
+		FILE *fp = stderr;
+
+		if (options.stats_file) {
+			fp = fopen(options.stats_file, "w");
+			if (!fp) {
+				fprintf(stderr, "Can't open %s\n", options.stats_file);
+				fp = stderr;
+			}
+		}
+
+		stats_dump(fp);
+
+		if (fp != stderr) {
+			fclose(fp);
+		}
+	}
+
+	hex_free(&image);
+	hex_free(&verify_image);
 out_parse:
 	return err ? EXIT_FAILURE : EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,214 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+enum {
+	STATS_MAX_HISTS = 64,
+	STATS_NAME_SIZE = 48,
+	// 8 buckets per power of two, about 12% resolution
+	STATS_SUB_BITS = 3,
+	STATS_BUCKETS = 64 << STATS_SUB_BITS,
+};
+
+typedef struct {
+	char name[STATS_NAME_SIZE];
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+static int stats_enabled = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_hist_t *stats_hists;
+static int stats_nhists;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value)
+{
+	int msb;
+
+	if (value < (1 << STATS_SUB_BITS)) {
+		return value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+
+	return (msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS |
+		(value >> (msb - STATS_SUB_BITS) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+static uint64_t bucket_value(int index)
+{
+	int msb;
+	uint64_t lower;
+
+	if (index < (1 << STATS_SUB_BITS)) {
+		return index;
+	}
+
+	msb = (index >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	lower = (uint64_t)((1 << STATS_SUB_BITS) | (index & ((1 << STATS_SUB_BITS) - 1))) << (msb - STATS_SUB_BITS);
+
+	// Middle of the bucket
+	return lower + ((1ull << (msb - STATS_SUB_BITS)) >> 1);
+}
+
+static stats_hist_t *hist_get(const char *name)
+{
+	for (int i = 0; i < stats_nhists; i++) {
+		if (!strcmp(stats_hists[i].name, name)) {
+			return &stats_hists[i];
+		}
+	}
+
+	if (stats_nhists == STATS_MAX_HISTS) {
+		return NULL;
+	}
+
+	stats_hist_t *hist = &stats_hists[stats_nhists++];
+	snprintf(hist->name, sizeof(hist->name), "%s", name);
+	hist->min_ns = UINT64_MAX;
+
+	return hist;
+}
+
+void stats_enable(void)
+{
+	pthread_mutex_lock(&stats_lock);
+
+	if (!stats_hists) {
+		stats_hists = calloc(STATS_MAX_HISTS, sizeof(*stats_hists));
+	}
+	stats_enabled = stats_hists != NULL;
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t stats_begin(void)
+{
+	return stats_enabled ? now_ns() : 0;
+}
+
+void stats_record(const char *name, uint64_t start_ns, int bytes)
+{
+	uint64_t elapsed;
+	stats_hist_t *hist;
+
+	if (!start_ns) {
+		return;
+	}
+
+	elapsed = now_ns() - start_ns;
+
+	pthread_mutex_lock(&stats_lock);
+
+	hist = hist_get(name);
+	if (hist) {
+		hist->count++;
+		hist->bytes += bytes;
+		hist->total_ns += elapsed;
+		hist->min_ns = elapsed < hist->min_ns ? elapsed : hist->min_ns;
+		hist->max_ns = elapsed > hist->max_ns ? elapsed : hist->max_ns;
+		hist->buckets[bucket_index(elapsed)]++;
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static uint64_t hist_percentile(const stats_hist_t *hist, int percent)
+{
+	uint64_t rank = (hist->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	uint64_t value = hist->max_ns;
+
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			value = bucket_value(i);
+			break;
+		}
+	}
+
+	// The bucket middle can fall outside what was actually seen
+	if (value < hist->min_ns) {
+		value = hist->min_ns;
+	}
+	if (value > hist->max_ns) {
+		value = hist->max_ns;
+	}
+
+	return value;
+}
+
+static int hist_compare(const void *a, const void *b)
+{
+	return strcmp(((const stats_hist_t *)a)->name, ((const stats_hist_t *)b)->name);
+}
+
+void stats_dump(FILE *fp)
+{
+	pthread_mutex_lock(&stats_lock);
+
+	if (!stats_enabled) {
+		goto out;
+	}
+
+	qsort(stats_hists, stats_nhists, sizeof(*stats_hists), hist_compare);
+
+	fprintf(fp, "{\n");
+	for (int i = 0; i < stats_nhists; i++) {
+		const stats_hist_t *hist = &stats_hists[i];
+
+		fprintf(fp, "  \"%s\": {\"count\": %llu, \"bytes\": %llu, \"total_us\": %.1f, "
+			"\"min_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}%s\n",
+			hist->name,
+			(unsigned long long)hist->count,
+			(unsigned long long)hist->bytes,
+			hist->total_ns / 1000.0,
+			hist->min_ns / 1000.0,
+			hist_percentile(hist, 50) / 1000.0,
+			hist_percentile(hist, 99) / 1000.0,
+			hist->max_ns / 1000.0,
+			i + 1 < stats_nhists ? "," : "");
+	}
+	fprintf(fp, "}\n");
+
+out:
+	pthread_mutex_unlock(&stats_lock);
+}
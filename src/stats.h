@@ -0,0 +1,45 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "tools.h"
+
+/**
+ * Counters and latency histograms, keyed by name.
+ * Nothing is recorded unless stats are enabled, stats_begin() then
+ * returns 0 and stats_record() ignores it. Safe to use from the gang
+ * worker threads.
+ */
+void stats_enable(void);
+uint64_t stats_begin(void);
+void stats_record(const char *name, uint64_t start_ns, int bytes);
+
+/**
+ * Print every histogram as a JSON object: count, bytes and
+ * min/p50/p99/max latency in microseconds.
+ */
+void stats_dump(FILE *fp);
+
+#endif
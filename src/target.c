@@ -23,8 +23,15 @@
 
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "crc.h"
+#include "stats.h"
 #include "target.h"
 #include "usb.h"
+#include "wait.h"
 
 err_t target_read_config(ccd_ctx_t *ctx, uint8_t *config)
 {
@@ -33,7 +40,7 @@ err_t target_read_config(ccd_ctx_t *ctx, uint8_t *config)
 
 	log_print("[Target] Read config\n");
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, cmd, sizeof(cmd));
+	err = usb_bulk_submit(ctx->usb, USB_OUT, cmd, sizeof(cmd), NULL, NULL);
 	noerr_or_out(err);
 	
 	err = usb_bulk_transfer(ctx->usb, USB_IN, config, sizeof(*config));
@@ -53,7 +60,7 @@ err_t target_write_config(ccd_ctx_t *ctx, uint8_t config)
 
 	log_print("[Target] Write config 0x%02x\n", config);
 
-	return usb_bulk_transfer(ctx->usb, USB_OUT, cmd, sizeof(cmd));
+	return usb_bulk_submit(ctx->usb, USB_OUT, cmd, sizeof(cmd), NULL, NULL);
 }
 
 err_t target_read_status(ccd_ctx_t *ctx, uint8_t *status)
@@ -63,7 +70,7 @@ err_t target_read_status(ccd_ctx_t *ctx, uint8_t *status)
 
 	log_print("[Target] Read status\n");
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, cmd, sizeof(cmd));
+	err = usb_bulk_submit(ctx->usb, USB_OUT, cmd, sizeof(cmd), NULL, NULL);
 	noerr_or_out(err);
 	
 	err = usb_bulk_transfer(ctx->usb, USB_IN, status, sizeof(*status));
@@ -81,213 +88,442 @@ err_t target_erase(ccd_ctx_t *ctx)
 
 	log_print("[Target] Erase flash\n");
 
-	return usb_bulk_transfer(ctx->usb, USB_OUT, cmd, sizeof(cmd));
+	return usb_bulk_submit(ctx->usb, USB_OUT, cmd, sizeof(cmd), NULL, NULL);
 }
 
-err_t target_command_add(void **cmd, int *size, void *data, int data_size)
+static const uint8_t cmd_header[] = {
+	0x40, 0x55, 0x00, 0x72, 0x56, 0xe5, 0x92, 0xbe,
+	0x57, 0x75, 0x92, 0x00, 0x74, 0x56, 0xe5, 0x83,
+	0x76, 0x56, 0xe5, 0x82
+};
+
+static const uint8_t cmd_footer[] = {
+	0xd4, 0x57, 0x90, 0xc2, 0x57, 0x75, 0x92, 0x90,
+	0x56, 0x74
+};
+
+// MOV DPTR,#addr16
+static const uint8_t instr_set_dptr[] = {
+	0xbe, 0x57, 0x90, 0x00, 0x00,
+};
+
+// MOVX A,@DPTR (output) ; INC DPTR
+static const uint8_t instr_read_byte[] = {
+	0x4e, 0x55, 0xe0,
+	0x5e, 0x55, 0xa3,
+};
+
+// MOV A,#data ; MOVX @DPTR,A ; INC DPTR
+static const uint8_t instr_write_byte[] = {
+	0x8e, 0x56, 0x74, 0x00,
+	0x5e, 0x55, 0xf0,
+	0x5e, 0x55, 0xa3,
+};
+
+// MOVX A,@DPTR ; ORL A,#data ; MOVX @DPTR,A
+static const uint8_t instr_set_bits[] = {
+	0x5e, 0x55, 0xe0,
+	0x8e, 0x56, 0x44, 0x00,
+	0x5e, 0x55, 0xf0,
+};
+
+err_t target_command_reserve(ccd_ctx_t *ctx, int size)
 {
 	err_t err = err_failed;
+	int capacity = ctx->cmd_capacity ? ctx->cmd_capacity : TARGET_CMD_CAPACITY;
+	uint8_t *cmd;
+
+	if (size <= ctx->cmd_capacity) {
+		err = err_none;
+		goto out;
+	}
+
+	while (capacity < size) {
+		capacity *= 2;
+	}
 
-	*cmd = realloc(*cmd, *size + data_size);
-	if (*cmd == NULL) {
+	cmd = realloc(ctx->cmd, capacity);
+	if (!cmd) {
+		err = err_oom;
 		error_out("Can't allocate memory\n");
 	}
 
-	memcpy((uint8_t*)*cmd + *size, data, data_size);
-	*size += data_size;
+	ctx->cmd = cmd;
+	ctx->cmd_capacity = capacity;
 
 	err = err_none;
 
 out:
-	return err;	
+	return err;
 }
 
-err_t target_command_init(void **cmd, int *size)
+static err_t txn_reserve(target_txn_t *txn, int size, uint8_t **cur)
 {
-	static uint8_t header[] = { 
-		0x40, 0x55, 0x00, 0x72, 0x56, 0xe5, 0x92, 0xbe, 
-		0x57, 0x75, 0x92, 0x00, 0x74, 0x56, 0xe5, 0x83,
-		0x76, 0x56, 0xe5, 0x82
-	};
+	err_t err;
 
-	*cmd = NULL;
-	*size = 0;
+	// Room for the footer is always kept so commit can't fail to grow
+	err = target_command_reserve(txn->ctx, txn->cmd_size + size + sizeof(cmd_footer));
+	noerr_or_out(err);
+
+	*cur = txn->ctx->cmd + txn->cmd_size;
+	txn->cmd_size += size;
 
-	return target_command_add(cmd, size, header, sizeof(header));
+out:
+	return err;
 }
 
-err_t target_command_finalize(void **cmd, int *size)
+err_t target_txn_init(ccd_ctx_t *ctx, target_txn_t *txn)
 {
-	static uint8_t footer[] = { 
-		0xd4, 0x57, 0x90, 0xc2, 0x57, 0x75, 0x92, 0x90,
-		0x56, 0x74
-	};
+	err_t err;
+	uint8_t *cur;
+
+	txn->ctx = ctx;
+	txn->cmd_size = 0;
+	txn->last_read = -1;
+	txn->read_size = 0;
+	txn->nreads = 0;
+
+	err = txn_reserve(txn, sizeof(cmd_header), &cur);
+	noerr_or_out(err);
 
-	return target_command_add(cmd, size, footer, sizeof(footer));
+	memcpy(cur, cmd_header, sizeof(cmd_header));
+
+out:
+	return err;
 }
 
-err_t target_read_xdata(ccd_ctx_t *ctx, uint16_t addr, uint8_t *data, int size)
+void target_txn_abort(target_txn_t *txn)
 {
-	err_t err = err_failed;
-	void *cmd = NULL;
-	int cmd_size;
+	txn->cmd_size = 0;
+	txn->nreads = 0;
+	txn->read_size = 0;
+}
 
-	static uint8_t mov_dptr_addr16[] = {
-		0xbe, 0x57,
-		0x90, 0x0, 0x0
-	};
+static uint8_t *txn_set_dptr(uint8_t *cur, uint16_t addr)
+{
+	memcpy(cur, instr_set_dptr, sizeof(instr_set_dptr));
+	cur[3] = addr >> 8;
+	cur[4] = addr & 0xff;
 
-	static uint8_t mov_a_dptr[] = {
-		0x4e, 0x55,
-		0xe0
-	};
+	return cur + sizeof(instr_set_dptr);
+}
 
-	static uint8_t inc_dptr[] = {
-		0x5e, 0x55,
-		0xa3
-	};
+err_t target_txn_read(target_txn_t *txn, uint16_t addr, uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	uint8_t *cur;
 
-	log_print("[Target] Read %dB of xdata at 0x%04x\n", size, addr);
+	if (txn->nreads == TARGET_TXN_MAX_READS) {
+		error_out("Too many reads in transaction\n");
+	}
 
-	err = target_command_init(&cmd, &cmd_size);
+	err = txn_reserve(txn, sizeof(instr_set_dptr) + size * sizeof(instr_read_byte), &cur);
 	noerr_or_out(err);
 
-	mov_dptr_addr16[4] = addr & 0xff;
-	mov_dptr_addr16[3] = addr >> 8;
-	err = target_command_add(&cmd, &cmd_size, mov_dptr_addr16, sizeof(mov_dptr_addr16));
+	cur = txn_set_dptr(cur, addr);
+	for (int i = 0; i < size; i++) {
+		memcpy(cur, instr_read_byte, sizeof(instr_read_byte));
+		cur += sizeof(instr_read_byte);
+	}
+
+	if (size) {
+		txn->last_read = txn->cmd_size - sizeof(instr_read_byte);
+	}
+
+	txn->reads[txn->nreads].data = data;
+	txn->reads[txn->nreads].size = size;
+	txn->nreads++;
+	txn->read_size += size;
+
+out:
+	return err;
+}
+
+err_t target_txn_write(target_txn_t *txn, uint16_t addr, const uint8_t *data, int size)
+{
+	err_t err;
+	uint8_t *cur;
+
+	err = txn_reserve(txn, sizeof(instr_set_dptr) + size * sizeof(instr_write_byte), &cur);
 	noerr_or_out(err);
 
+	cur = txn_set_dptr(cur, addr);
 	for (int i = 0; i < size; i++) {
-		mov_a_dptr[0] = (i == size-1) ? 0x4f : 0x4e;
-
-		err = target_command_add(&cmd, &cmd_size, mov_a_dptr, sizeof(mov_a_dptr));
-		noerr_or_out(err);
-		err = target_command_add(&cmd, &cmd_size, inc_dptr, sizeof(inc_dptr));
-		noerr_or_out(err);
+		memcpy(cur, instr_write_byte, sizeof(instr_write_byte));
+		cur[3] = data[i];
+		cur += sizeof(instr_write_byte);
 	}
 
-	err = target_command_finalize(&cmd, &cmd_size);
+out:
+	return err;
+}
+
+err_t target_txn_write_byte(target_txn_t *txn, uint16_t addr, uint8_t val)
+{
+	return target_txn_write(txn, addr, &val, sizeof(val));
+}
+
+err_t target_txn_set_bits(target_txn_t *txn, uint16_t addr, uint8_t bits)
+{
+	err_t err;
+	uint8_t *cur;
+
+	// Read-modify-write on the target, no round trip needed
+	err = txn_reserve(txn, sizeof(instr_set_dptr) + sizeof(instr_set_bits), &cur);
 	noerr_or_out(err);
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, cmd, cmd_size);
+	cur = txn_set_dptr(cur, addr);
+	memcpy(cur, instr_set_bits, sizeof(instr_set_bits));
+	cur[6] = bits;
+
+out:
+	return err;
+}
+
+static err_t txn_send(target_txn_t *txn)
+{
+	ccd_ctx_t *ctx = txn->ctx;
+
+	log_print("[Target] Commit transaction (%dB command, %dB read)\n",
+		txn->cmd_size, txn->read_size);
+
+	// Only the last read flushes the collected bytes back to the host
+	if (txn->last_read >= 0) {
+		ctx->cmd[txn->last_read] = 0x4f;
+	}
+
+	memcpy(ctx->cmd + txn->cmd_size, cmd_footer, sizeof(cmd_footer));
+	txn->cmd_size += sizeof(cmd_footer);
+
+	return usb_bulk_submit(ctx->usb, USB_OUT, ctx->cmd, txn->cmd_size, NULL, NULL);
+}
+
+err_t target_txn_commit(target_txn_t *txn)
+{
+	err_t err = err_failed;
+	ccd_ctx_t *ctx = txn->ctx;
+	uint8_t *data;
+
+	err = txn_send(txn);
 	noerr_or_out(err);
 
-	err = usb_bulk_transfer(ctx->usb, USB_IN, data, size);
+	if (!txn->read_size) {
+		goto out;
+	}
+
+	// The command was copied by the usb layer, the arena now holds the answer
+	data = txn->reads[0].data;
+	if (txn->nreads > 1) {
+		err = target_command_reserve(ctx, txn->read_size);
+		noerr_or_out(err);
+		data = ctx->cmd;
+	}
+
+	err = usb_bulk_transfer(ctx->usb, USB_IN, data, txn->read_size);
 	noerr_or_out(err);
 
-	err = err_none;
+	if (txn->nreads > 1) {
+		for (int i = 0; i < txn->nreads; i++) {
+			memcpy(txn->reads[i].data, data, txn->reads[i].size);
+			data += txn->reads[i].size;
+		}
+	}
 
 out:
-	if (cmd) {
-		free(cmd);
-	}
+	target_txn_abort(txn);
 
 	return err;
 }
 
-err_t target_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
+err_t target_txn_submit(target_txn_t *txn)
 {
 	err_t err = err_failed;
-	void *cmd = NULL;
-	int cmd_size;
 
-	static uint8_t mov_dptr_addr16[] = {
-		0xbe, 0x57,
-		0x90, 0x0, 0x0
-	};
+	if (txn->nreads > 1) {
+		error_out("Can't submit a transaction with several reads\n");
+	}
 
-	static uint8_t mov_a_data[] = {
-		0x8e, 0x56,
-		0x74, 0x0
-	};
+	err = txn_send(txn);
+	noerr_or_out(err);
 
-	static uint8_t mov_dptr_a[] = {
-		0x5e, 0x55,
-		0xf0
-	};
+	if (txn->read_size) {
+		err = usb_bulk_submit(txn->ctx->usb, USB_IN, txn->reads[0].data, txn->read_size, NULL, NULL);
+		noerr_or_out(err);
+	}
 
-	static uint8_t inc_dptr[] = {
-		0x5e, 0x55,
-		0xa3
-	};
+out:
+	target_txn_abort(txn);
 
-	log_print("[Target] Write %dB of xdata at 0x%04x\n", size, addr);
-	log_bytes(data, size);
+	return err;
+}
 
-	err = target_command_init(&cmd, &cmd_size);
-	noerr_or_out(err);
+static err_t flash_bank(target_txn_t *txn, int bank)
+{
+	log_print("[Target] Map flash bank %d\n", bank);
 
-	mov_dptr_addr16[4] = addr & 0xff;
-	mov_dptr_addr16[3] = addr >> 8;
-	err = target_command_add(&cmd, &cmd_size, mov_dptr_addr16, sizeof(mov_dptr_addr16));
-	noerr_or_out(err);
+	return target_txn_write_byte(txn, MEMORY_CONTROL, bank & MEMORY_CONTROL_BANK);
+}
 
-	for (int i = 0; i < size; i++) {
-		mov_a_data[3] = data[i];
+/*
+ * The debug interface has a burst write but no burst read: data only
+ * leaves the target as the output of a debug instruction. Staging it in
+ * SRAM by DMA first wouldn't save anything, so reads stay at the two
+ * instructions per byte of instr_read_byte, 6 command bytes, and only the
+ * round trips are saved by queueing the blocks.
+ */
+static err_t read_blocks(ccd_ctx_t *ctx, int bank, uint16_t addr, uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	const int block_size = 1024;
+	target_txn_t txn = { .cmd_size = 0 };
+
+	// Every block is queued, the answers land in place as they come back
+	while (size) {
+		int current_size = size > block_size ? block_size : size;
 
-		err = target_command_add(&cmd, &cmd_size, mov_a_data, sizeof(mov_a_data));
+		err = target_txn_init(ctx, &txn);
 		noerr_or_out(err);
-		err = target_command_add(&cmd, &cmd_size, mov_dptr_a, sizeof(mov_dptr_a));
+
+		if (bank >= 0) {
+			err = flash_bank(&txn, bank);
+			noerr_or_out(err);
+		}
+
+		err = target_txn_read(&txn, addr, data, current_size);
 		noerr_or_out(err);
 
-		err = target_command_add(&cmd, &cmd_size, inc_dptr, sizeof(inc_dptr));
+		err = target_txn_submit(&txn);
 		noerr_or_out(err);
+
+		addr += current_size;
+		data += current_size;
+		size -= current_size;
 	}
 
-	err = target_command_finalize(&cmd, &cmd_size);
+	err = usb_flush(ctx->usb);
 	noerr_or_out(err);
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, cmd, cmd_size);
-	noerr_or_out(err);
+out:
+	target_txn_abort(&txn);
+	return err;
+}
 
-	err = err_none;
+err_t target_read_xdata(ccd_ctx_t *ctx, uint16_t addr, uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	target_txn_t txn = { .cmd_size = 0 };
 
-out:
-	if (cmd) {
-		free(cmd);
+	log_print("[Target] Read %dB of xdata at 0x%04x\n", size, addr);
+
+	if (size > TARGET_TXN_MAX_READ) {
+		err = read_blocks(ctx, -1, addr, data, size);
+		noerr_or_out(err);
+		goto out;
 	}
 
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = target_txn_read(&txn, addr, data, size);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+out:
+	target_txn_abort(&txn);
 	return err;
 }
 
-static err_t flag_set(ccd_ctx_t *ctx, uint16_t address, uint8_t flag)
+err_t target_read_code(ccd_ctx_t *ctx, uint32_t addr, uint8_t *data, int size)
 {
-	err_t err;
-	uint8_t flash_ctrl;
+	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
+	int total_size = size;
+	target_txn_t txn = { .cmd_size = 0 };
 
-	log_print("[Target] Flash set flag 0x%02x\n", flag);
+	log_print("[Target] Read %dB of flash at 0x%05x\n", size, addr);
+
+	if (addr + size > TARGET_FLASH_MAX_SIZE) {
+		error_out("Flash reading beyond 0x%05x\n", TARGET_FLASH_MAX_SIZE);
+	}
+
+	// Read through the flash window, one bank at a time
+	while (size) {
+		int bank = addr / TARGET_FLASH_BANK_SIZE;
+		uint16_t offset = addr % TARGET_FLASH_BANK_SIZE;
+		int current_size = TARGET_FLASH_BANK_SIZE - offset;
+
+		if (current_size > size) {
+			current_size = size;
+		}
+
+		err = read_blocks(ctx, bank, XDATA_FLASH + offset, data, current_size);
+		noerr_or_out(err);
+
+		addr += current_size;
+		data += current_size;
+		size -= current_size;
+	}
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
 
-	err = target_read_xdata(ctx, address, &flash_ctrl, sizeof(flash_ctrl));
+	err = flash_bank(&txn, 0);
 	noerr_or_out(err);
 
-	flash_ctrl |= flag;
-	err = target_write_xdata(ctx, address, &flash_ctrl, sizeof(flash_ctrl));
+	err = target_txn_commit(&txn);
 	noerr_or_out(err);
 
+	stats_record("phase.read", start_ns, total_size);
+
 out:
+	target_txn_abort(&txn);
 	return err;
 }
 
-static err_t flag_wait_cleared(ccd_ctx_t *ctx, uint16_t address, uint8_t flag)
+static err_t flag_set(target_txn_t *txn, uint16_t address, uint8_t flag)
 {
-	err_t err;
-	uint8_t byte = 0;
+	log_print("[Target] Flash set flag 0x%02x\n", flag);
 
-	log_print("[Target] Flash wait for flag 0x%02x cleared\n", flag);
+	return target_txn_set_bits(txn, address, flag);
+}
 
-	do {
-		if (byte) {
-			usleep(200);
-		}
+typedef struct {
+	ccd_ctx_t *ctx;
+	uint16_t address;
+	uint8_t flag;
+} flag_poll_t;
 
-		err = target_read_xdata(ctx, address, &byte, sizeof(byte));
-		noerr_or_out(err);
-	} while (byte & flag);
+static err_t flag_poll(void *arg, int *done)
+{
+	err_t err;
+	flag_poll_t *poll = arg;
+	uint8_t byte;
+
+	err = target_read_xdata(poll->ctx, poll->address, &byte, sizeof(byte));
+	noerr_or_out(err);
+
+	*done = !(byte & poll->flag);
 
 out:
 	return err;
 }
 
+/**
+ * Wait for a flag to be cleared by an operation of some units started
+ * at start_us, see wait_until().
+ */
+static err_t flag_wait_cleared(ccd_ctx_t *ctx, uint16_t address, uint8_t flag,
+	wait_op_t op, int units, uint64_t start_us)
+{
+	flag_poll_t poll = { ctx, address, flag };
+
+	log_print("[Target] Flash wait for flag 0x%02x cleared\n", flag);
+
+	return wait_until(&ctx->wait, op, units, start_us, flag_poll, &poll);
+}
+
 typedef struct {
 	int is_dma0;
 	uint8_t configs[4][8];
@@ -337,135 +573,159 @@ out:
 	return err;	
 }
 
+static err_t dma_config_address(
+	target_txn_t *txn, dma_config_t *config, uint16_t temp_addr)
+{
+	uint8_t addr[2];
+	int dma_addr_low = config->is_dma0 ? DMA0_ADDR_LOW : DMA14_ADDR_LOW;
+
+	addr[0] = temp_addr & 0xff;
+	addr[1] = temp_addr >> 8;
+
+	return target_txn_write(txn, dma_addr_low, addr, sizeof(addr));
+}
+
+static int dma_config_size(dma_config_t *config)
+{
+	// DMA0 has a single descriptor, DMA1-4 descriptors are contiguous
+	return config->is_dma0 ? sizeof(config->configs[0]) : sizeof(config->configs);
+}
+
 static err_t dma_config_commit(
-	ccd_ctx_t *ctx, dma_config_t *config, uint16_t temp_addr)
+	target_txn_t *txn, dma_config_t *config, uint16_t temp_addr)
 {
 	err_t err = err_failed;
-	uint8_t val;
-	int dma_addr_low = config->is_dma0 ? DMA0_ADDR_LOW : DMA14_ADDR_LOW;
-	int dma_addr_high = config->is_dma0 ? DMA0_ADDR_HIGH : DMA14_ADDR_HIGH;
 
 	if (config->is_dma0 == -1) {
 		error_out("Can't commit before DMA config is done\n");
 	}
 
-	err = target_write_xdata(ctx, temp_addr, (uint8_t *)config->configs, sizeof(config->configs));
+	err = target_txn_write(
+		txn, temp_addr, (uint8_t *)config->configs, dma_config_size(config));
 	noerr_or_out(err);
 
-	val = temp_addr & 0xff;
-	err = target_write_xdata(ctx, dma_addr_low, &val, sizeof(val));
-	noerr_or_out(err);
-
-	val = temp_addr >> 8;
-	err = target_write_xdata(ctx, dma_addr_high, &val, sizeof(val));
+	err = dma_config_address(txn, config, temp_addr);
 	noerr_or_out(err);
 
 out:
 	return err;
 }
 
-static err_t dma_arm(ccd_ctx_t *ctx, int channel)
+static err_t dma_arm(target_txn_t *txn, int channel)
 {
-	err_t err;
-	uint8_t val;
-
 	log_print("[Target] Arm dma channel %d\n", channel);
 
-	val = 1 << channel;
-	err = target_write_xdata(ctx, DMA_ARM, &val, sizeof(val));
-	noerr_or_out(err);
-
-out:
-	return err;
+	return target_txn_write_byte(txn, DMA_ARM, 1 << channel);
 }
 
-static err_t dma_request(ccd_ctx_t *ctx, int channel)
+static err_t dma_request(target_txn_t *txn, int channel)
 {
-	err_t err;
-	uint8_t val;
-
 	log_print("[Target] Request DMA on channel %d\n", channel);
 
-	val = 1 << channel;
-	err = target_write_xdata(ctx, DMA_REQ, &val, sizeof(val));
-	noerr_or_out(err);
-
-out:
-	return err;
+	return target_txn_write_byte(txn, DMA_REQ, 1 << channel);
 }
 
-static err_t dma_wait_completion(ccd_ctx_t *ctx, int channel)
+static err_t dma_wait_completion(ccd_ctx_t *ctx, int channel, int size, uint64_t start_us)
 {
 	err_t err;
 
 	log_print("[Target] Wait for DMA completion on channel %d\n", channel);
 
-	err = flag_wait_cleared(ctx, DMA_IRQ, 1 << channel);
+	// The arm bit is cleared by the controller once the transfer is done
+	err = flag_wait_cleared(ctx, DMA_ARM, 1 << channel, wait_dma, size, start_us);
 	noerr_or_out(err);
 
 out:
 	return err;
 }
 
-static err_t rng_seed(ccd_ctx_t *ctx, uint16_t seed)
+static err_t rng_seed(target_txn_t *txn, uint16_t seed)
 {
 	err_t err;
-	uint8_t val;
 
 	log_print("[Target] Set RNG seed to 0x%02x\n", seed);
 
-	val = seed >> 8;
-	err = target_write_xdata(ctx, RNG_DATA_LOW, &val, sizeof(val));
+	err = target_txn_write_byte(txn, RNG_DATA_LOW, seed >> 8);
 	noerr_or_out(err);
 
-	val = seed & 0xff;
-	err = target_write_xdata(ctx, RNG_DATA_LOW, &val, sizeof(val));
+	err = target_txn_write_byte(txn, RNG_DATA_LOW, seed & 0xff);
 	noerr_or_out(err);
 
 out:
 	return err;
 }
 
-static err_t rng_get_crc16(ccd_ctx_t *ctx, uint16_t *crc16)
+static err_t rng_get_crc16(target_txn_t *txn, uint8_t crc16[2])
+{
+	log_print("[Target] Get RNG CRC value\n");
+
+	// RNG_DATA_LOW and RNG_DATA_HIGH are adjacent
+	return target_txn_read(txn, RNG_DATA_LOW, crc16, 2);
+}
+
+typedef struct {
+	ccd_ctx_t *ctx;
+	uint8_t crc16[2];
+} crc16_poll_t;
+
+static err_t crc16_poll(void *arg, int *done)
 {
 	err_t err;
-	uint8_t val;
+	crc16_poll_t *poll = arg;
+	target_txn_t txn = { .cmd_size = 0 };
+	uint8_t armed;
 
-	log_print("[Target] Get RNG CRC value\n");
+	// Completion check and result come back in the same round trip
+	err = target_txn_init(poll->ctx, &txn);
+	noerr_or_out(err);
 
-	err = target_read_xdata(ctx, RNG_DATA_LOW, &val, sizeof(val));
+	err = target_txn_read(&txn, DMA_ARM, &armed, sizeof(armed));
 	noerr_or_out(err);
 
-	*crc16 = val;
+	err = rng_get_crc16(&txn, poll->crc16);
+	noerr_or_out(err);
 
-	err = target_read_xdata(ctx, RNG_DATA_HIGH, &val, sizeof(val));
+	err = target_txn_commit(&txn);
 	noerr_or_out(err);
 
-	*crc16 |= val << 8;
+	*done = !(armed & 0x01);
 
 out:
+	target_txn_abort(&txn);
 	return err;
 }
 
-static err_t flash_setup(ccd_ctx_t *ctx, uint16_t addr)
+/**
+ * Wait for the DMA0 transfer of size bytes into the RNG, then get the CRC.
+ */
+static err_t rng_wait_crc16(ccd_ctx_t *ctx, int size, uint64_t start_us, uint16_t *crc16)
 {
 	err_t err;
-	uint8_t val;
+	crc16_poll_t poll = { .ctx = ctx };
 
-	log_print("[Target] Flash setup at 0x%04x\n", addr);
-
-	val = addr & 0xff;
-	err = target_write_xdata(ctx, FLASH_ADDR_LOW, &val, sizeof(val));
+	err = wait_until(&ctx->wait, wait_dma, size, start_us, crc16_poll, &poll);
 	noerr_or_out(err);
 
-	val = addr >> 8;
-	err = target_write_xdata(ctx, FLASH_ADDR_HIGH, &val, sizeof(val));
-	noerr_or_out(err);
+	*crc16 = poll.crc16[0] | poll.crc16[1] << 8;
 
 out:
 	return err;
 }
 
+static err_t flash_setup(target_txn_t *txn, uint32_t addr)
+{
+	uint8_t val[2];
+
+	log_print("[Target] Flash setup at 0x%05x\n", addr);
+
+	// The flash controller takes a word address
+	// FLASH_ADDR_LOW and FLASH_ADDR_HIGH are adjacent
+	val[0] = (addr >> 2) & 0xff;
+	val[1] = addr >> 10;
+
+	return target_txn_write(txn, FLASH_ADDR_LOW, val, sizeof(val));
+}
+
 static err_t burst_write(ccd_ctx_t *ctx, const uint8_t *data, int size)
 {
 	err_t err;
@@ -476,147 +736,782 @@ static err_t burst_write(ccd_ctx_t *ctx, const uint8_t *data, int size)
 
 	log_print("[Target] Burst write %dB\n", size);
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, cmd, 3);
+	err = usb_bulk_submit(ctx->usb, USB_OUT, cmd, 3, NULL, NULL);
 	noerr_or_out(err);
 
-	err = usb_bulk_transfer(ctx->usb, USB_OUT, (void *)data, size);
+	err = usb_bulk_submit(ctx->usb, USB_OUT, (void *)data, size, NULL, NULL);
 	noerr_or_out(err);
 
 out:
 	return err;
 }
 
-err_t target_write_flash(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
+enum {
+	// DMA0 descriptor used by xdata bursts
+	XDATA_BURST_CONFIG = 0x0828,
+	// Bursts only go to SRAM, registers are written by instructions
+	XDATA_SRAM_END     = 0x2000,
+};
+
+static err_t write_xdata_burst(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
 {
 	err_t err = err_failed;
-	const int block_size = 1024;
-	const uint16_t temp_config_addr = 0x0800;
-	const uint16_t temp_data_addr = 0x0000;
-	static dma_config_t dma_config;
-
-	log_print("[Target] Write %dB to flash at 0x%04x\n", size, addr);
-	log_bytes(data, size);
+	dma_config_t dma_config;
+	target_txn_t txn = { .cmd_size = 0 };
 
 	dma_config_init(ctx, &dma_config);
 
-	if (size % 4) {
-		error_out("Flash writing requires blocks of 4 bytes\n");
-	}
+	// DMA from usb burst write to the destination
+	err = dma_config_channel(
+		ctx, &dma_config, 0,
+		DEBUG_WRITE_DATA, 0, addr, 1,
+		size, DMA_TRIG_DEBUG, DMA_TMODE_SINGLE);
+	noerr_or_out(err);
 
-	while (size) {
-		int current_size = size;
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
 
-		if (size > block_size) {
-			current_size = block_size;
-		}
+	err = dma_config_commit(&txn, &dma_config, XDATA_BURST_CONFIG);
+	noerr_or_out(err);
 
-		// DMA from usb burst write to temp address
-		err = dma_config_channel(
-			ctx, &dma_config, 1,
-			DEBUG_WRITE_DATA, 0, temp_data_addr, 1,
-			current_size, DMA_TRIG_DEBUG, DMA_TMODE_SINGLE);
-		noerr_or_out(err);
+	err = dma_arm(&txn, 0);
+	noerr_or_out(err);
 
-		// DMA from temp address to flash
-		err = dma_config_channel(
-			ctx, &dma_config, 2,
-			temp_data_addr, 1, FLASH_WRITE_DATA, 0,
-			current_size, DMA_TRIG_FLASH, DMA_TMODE_SINGLE);
-		noerr_or_out(err);
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
 
-		// Start burst write DMA
-		err = dma_config_commit(ctx, &dma_config, temp_config_addr);
-		noerr_or_out(err);
+	// Later commands are only run once the burst is consumed
+	err = burst_write(ctx, data, size);
+	noerr_or_out(err);
 
-		err = dma_arm(ctx, 1);
-		noerr_or_out(err);
+out:
+	target_txn_abort(&txn);
+	return err;
+}
 
-		err = burst_write(ctx, data, current_size);
-		noerr_or_out(err);
+/*
+ * Each byte costs about 10 command bytes when written by instructions,
+ * a burst costs a DMA0 descriptor and then the raw data.
+ * The destination has to be SRAM: DMA0 would otherwise run over the DMA
+ * and flash controller registers while it moves the data, and restoring
+ * DMA0 would clobber what was written there. The descriptor can't be
+ * part of the destination either.
+ */
+static int write_xdata_bursts(uint16_t addr, int size)
+{
+	return size >= TARGET_BURST_MIN_SIZE && addr + size <= XDATA_SRAM_END &&
+		(addr >= XDATA_BURST_CONFIG + 8 || addr + size <= XDATA_BURST_CONFIG);
+}
 
-		// Start Flash DMA
-		err = flash_setup(ctx, addr);
-		noerr_or_out(err);
+/**
+ * Same as target_write_xdata(), for the SRAM the flash path owns: the DMA0
+ * descriptor and address used by bursts are left behind.
+ */
+static err_t write_xdata(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	const int block_size = 1024;
+	target_txn_t txn = { .cmd_size = 0 };
 
-		err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_BUSY);
-		noerr_or_out(err);
+	if (write_xdata_bursts(addr, size)) {
+		while (size) {
+			int current_size = size > block_size ? block_size : size;
 
-		err = dma_arm(ctx, 2);
-		noerr_or_out(err);
+			err = write_xdata_burst(ctx, addr, data, current_size);
+			noerr_or_out(err);
 
-		err = flag_set(ctx, FLASH_CONTROL, FLASH_WRITE);
-		noerr_or_out(err);
+			addr += current_size;
+			data += current_size;
+			size -= current_size;
+		}
+		goto out;
+	}
 
-		err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_WRITE);
-		noerr_or_out(err);
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
 
-		size -= current_size;
-	}
+	err = target_txn_write(&txn, addr, data, size);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
 
 out:
+	target_txn_abort(&txn);
 	return err;
 }
 
-uint16_t compute_crc16(const uint8_t *data, int size, uint16_t init)
+err_t target_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
 {
-	uint16_t crc16 = init;
+	err_t err = err_failed;
+	uint8_t saved_config[8];
+	uint8_t saved_addr[2];
+	target_txn_t txn = { .cmd_size = 0 };
 
-	for (int i = 0; i < size; i++) {
-		uint8_t byte = *data++;
-		for (int b = 7; b >= 0; b-- ) {
-			uint8_t in_sum = ((crc16 & 0x8000) >> 15) ^ ((byte >> b) & 1);
-			crc16 = (crc16 << 1) | in_sum;
-			crc16 = crc16 ^ (in_sum << 15);
-			crc16 = crc16 ^ (in_sum << 2);
+	log_print("[Target] Write %dB of xdata at 0x%04x\n", size, addr);
+	log_bytes(data, size);
+
+	if (!write_xdata_bursts(addr, size)) {
+		err = write_xdata(ctx, addr, data, size);
+		goto out;
+	}
+
+	// The caller's SRAM and DMA0 setup are put back once the bursts are done
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = target_txn_read(&txn, XDATA_BURST_CONFIG, saved_config, sizeof(saved_config));
+	noerr_or_out(err);
+
+	err = target_txn_read(&txn, DMA0_ADDR_LOW, saved_addr, sizeof(saved_addr));
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+	err = write_xdata(ctx, addr, data, size);
+	noerr_or_out(err);
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = target_txn_write(&txn, XDATA_BURST_CONFIG, saved_config, sizeof(saved_config));
+	noerr_or_out(err);
+
+	err = target_txn_write(&txn, DMA0_ADDR_LOW, saved_addr, sizeof(saved_addr));
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+/**
+ * Same as dma_config_commit() in a transaction of its own, the
+ * descriptors are large enough to be burst.
+ */
+static err_t dma_config_upload(
+	ccd_ctx_t *ctx, dma_config_t *config, uint16_t temp_addr)
+{
+	err_t err = err_failed;
+	target_txn_t txn = { .cmd_size = 0 };
+
+	if (config->is_dma0 == -1) {
+		error_out("Can't commit before DMA config is done\n");
+	}
+
+	err = write_xdata(ctx, temp_addr, (uint8_t *)config->configs, dma_config_size(config));
+	noerr_or_out(err);
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = dma_config_address(&txn, config, temp_addr);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+static err_t dma_config_length(
+	target_txn_t *txn, uint16_t temp_addr, int channel, int size)
+{
+	uint8_t len[2];
+
+	// Patch LEN of an already committed DMA1-4 descriptor
+	len[0] = size >> 8;
+	len[1] = size & 0xff;
+
+	return target_txn_write(txn, temp_addr + (channel - 1) * 8 + 4, len, sizeof(len));
+}
+
+/**
+ * Find the words of a block that actually need programming.
+ * Returns 0 if the whole block is 0xff.
+ */
+static int find_programmed(const uint8_t *data, int size, int *first, int *last)
+{
+	int start = 0;
+	int end = size;
+
+#ifdef __SSE2__
+	const __m128i erased = _mm_set1_epi8(-1);
+
+	for (; start + 16 <= end; start += 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + start)), erased));
+		if (mask != 0xffff) {
+			start += __builtin_ctz(~mask);
+			break;
 		}
 	}
 
-	return crc16;
+	for (; end - 16 >= start; end -= 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + end - 16)), erased));
+		if (mask != 0xffff) {
+			end -= __builtin_clz(~mask & 0xffff) - 16;
+			break;
+		}
+	}
+#endif
+
+	while (start < end && data[start] == 0xff) {
+		start++;
+	}
+	while (end > start && data[end - 1] == 0xff) {
+		end--;
+	}
+
+	if (start == end) {
+		return 0;
+	}
+
+	// Flash is written by 4-byte words
+	*first = start & ~3;
+	*last = (end + 3) & ~3;
+
+	return 1;
 }
 
-err_t target_verify_flash(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size)
+static err_t check_block(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size, int *match)
 {
 	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
 	const uint16_t seed = 0xffff;
-	const uint16_t temp_config_addr = 0x0800;
-	static dma_config_t dma_config;
-	uint16_t crc16_target;
-	uint16_t crc16_host;
+	const uint16_t temp_config_addr = 0x0820;
+	dma_config_t dma_config;
+	target_txn_t txn = { .cmd_size = 0 };
+	uint16_t crc16;
+
+	log_print("[Target] Check %dB of flash at 0x%05x\n", size, addr);
 
 	dma_config_init(ctx, &dma_config);
 
-	// DMA from flash to RNG
+	// DMA from flash to RNG, blocks never cross a bank
 	err = dma_config_channel(
 		ctx, &dma_config, 0,
-		XDATA_FLASH + addr, 1, RNG_DATA_HIGH, 0,
+		XDATA_FLASH + addr % TARGET_FLASH_BANK_SIZE, 1, RNG_DATA_HIGH, 0,
 		size, 0, DMA_TMODE_BLOCK);
 	noerr_or_out(err);
 
-	err = dma_config_commit(ctx, &dma_config, temp_config_addr);
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = flash_bank(&txn, addr / TARGET_FLASH_BANK_SIZE);
+	noerr_or_out(err);
+
+	err = dma_config_commit(&txn, &dma_config, temp_config_addr);
+	noerr_or_out(err);
+
+	err = rng_seed(&txn, seed);
+	noerr_or_out(err);
+
+	err = dma_arm(&txn, 0);
+	noerr_or_out(err);
+
+	err = dma_request(&txn, 0);
 	noerr_or_out(err);
 
-	err = rng_seed(ctx, seed);
+	err = target_txn_commit(&txn);
 	noerr_or_out(err);
 
-	err = dma_arm(ctx, 0);
+	err = rng_wait_crc16(ctx, size, wait_now_us(), &crc16);
 	noerr_or_out(err);
 
-	err = dma_request(ctx, 0);
+	*match = crc16 == compute_crc16(data, size, seed);
+
+	stats_record("phase.verify_block", start_ns, size);
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+static err_t write_flash(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size, int flags, uint32_t *bad_pages)
+{
+	err_t err = err_failed;
+	const int block_size = 1024;
+	const uint16_t temp_config_addr = 0x0800;
+	const uint16_t temp_data_addr[2] = { 0x0000, 0x0400 };
+	dma_config_t dma_config;
+	target_txn_t txn = { .cmd_size = 0 };
+	int config_size[2] = { block_size, block_size };
+	int erased_page = -1;
+	uint32_t prev_addr = 0;
+	const uint8_t *prev_data = NULL;
+	int prev_size = 0;
+	int match;
+	int writing = 0;
+	int written = 0;
+	int write_words = 0;
+	uint64_t write_start = 0;
+	uint64_t erase_start = 0;
+
+	dma_config_init(ctx, &dma_config);
+
+	/*
+	 * Ping-pong between two SRAM buffers: channels 1 and 2 burst into and
+	 * flash from the first one, channels 3 and 4 do the same for the second
+	 * one. The burst of block N+1 runs while the flash controller is still
+	 * writing block N.
+	 */
+	for (int buffer = 0; buffer < 2; buffer++) {
+		// DMA from usb burst write to temp address
+		err = dma_config_channel(
+			ctx, &dma_config, 1 + 2 * buffer,
+			DEBUG_WRITE_DATA, 0, temp_data_addr[buffer], 1,
+			block_size, DMA_TRIG_DEBUG, DMA_TMODE_SINGLE);
+		noerr_or_out(err);
+
+		// DMA from temp address to flash
+		err = dma_config_channel(
+			ctx, &dma_config, 2 + 2 * buffer,
+			temp_data_addr[buffer], 1, FLASH_WRITE_DATA, 0,
+			block_size, DMA_TRIG_FLASH, DMA_TMODE_SINGLE);
+		noerr_or_out(err);
+	}
+
+	err = dma_config_upload(ctx, &dma_config, temp_config_addr);
 	noerr_or_out(err);
 
-	err = dma_wait_completion(ctx, 4);
+	err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_BUSY, wait_flash_write, 0, wait_now_us());
 	noerr_or_out(err);
 
-	err = rng_get_crc16(ctx, &crc16_target);
+	while (size) {
+		uint64_t block_start_ns = stats_begin();
+		int buffer = written & 1;
+		int burst_channel = 1 + 2 * buffer;
+		int flash_channel = 2 + 2 * buffer;
+		int page = addr / TARGET_FLASH_PAGE_SIZE;
+		int erase = (flags & TARGET_WRITE_ERASE) && page != erased_page;
+		int current_size = block_size - addr % block_size;
+		int first = 0, last = 0;
+		int blank;
+
+		// Blocks are aligned so that none of them straddles two pages
+		if (current_size > size) {
+			current_size = size;
+		}
+
+		// Programming 0xff leaves a flash word as it is, only the rest is sent
+		blank = !find_programmed(data, current_size, &first, &last);
+
+		// The page erase needs the controller, the previous block goes first
+		if (erase && writing) {
+			err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_WRITE, wait_flash_write, write_words, write_start);
+			noerr_or_out(err);
+			writing = 0;
+		}
+
+		err = target_txn_init(ctx, &txn);
+		noerr_or_out(err);
+
+		// Erase runs while the block is burst into SRAM
+		if (erase) {
+			log_print("[Target] Erase flash page %d\n", page);
+
+			err = flash_setup(&txn, (uint32_t)page * TARGET_FLASH_PAGE_SIZE);
+			noerr_or_out(err);
+
+			err = flag_set(&txn, FLASH_CONTROL, FLASH_ERASE);
+			noerr_or_out(err);
+
+			erased_page = page;
+			erase_start = wait_now_us();
+		}
+
+		if (blank) {
+			log_print("[Target] Skip blank block at 0x%05x\n", addr);
+		}
+		else {
+			// Start burst write DMA
+			if (last - first != config_size[buffer]) {
+				err = dma_config_length(&txn, temp_config_addr, burst_channel, last - first);
+				noerr_or_out(err);
+				err = dma_config_length(&txn, temp_config_addr, flash_channel, last - first);
+				noerr_or_out(err);
+				config_size[buffer] = last - first;
+			}
+
+			err = dma_arm(&txn, burst_channel);
+			noerr_or_out(err);
+		}
+
+		if (erase || !blank) {
+			err = target_txn_commit(&txn);
+			noerr_or_out(err);
+		}
+		else {
+			target_txn_abort(&txn);
+		}
+
+		if (!blank) {
+			err = burst_write(ctx, data + first, last - first);
+			noerr_or_out(err);
+		}
+
+		// Previous block or erase has to be done before the controller is reused
+		if (erase) {
+			err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_BUSY | FLASH_ERASE, wait_page_erase, 1, erase_start);
+			noerr_or_out(err);
+		}
+		else if (writing) {
+			err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_WRITE, wait_flash_write, write_words, write_start);
+			noerr_or_out(err);
+		}
+		writing = 0;
+
+		// The previous block is settled, check it behind the burst of this one
+		if ((flags & TARGET_WRITE_VERIFY) && prev_data) {
+			err = check_block(ctx, prev_addr, prev_data, prev_size, &match);
+			noerr_or_out(err);
+
+			if (!match) {
+				bad_pages[prev_addr / TARGET_FLASH_PAGE_SIZE / 32] |= 1u << (prev_addr / TARGET_FLASH_PAGE_SIZE % 32);
+			}
+		}
+
+		// Start Flash DMA
+		if (!blank) {
+			err = target_txn_init(ctx, &txn);
+			noerr_or_out(err);
+
+			err = flash_setup(&txn, addr + first);
+			noerr_or_out(err);
+
+			err = dma_arm(&txn, flash_channel);
+			noerr_or_out(err);
+
+			err = flag_set(&txn, FLASH_CONTROL, FLASH_WRITE);
+			noerr_or_out(err);
+
+			err = target_txn_commit(&txn);
+			noerr_or_out(err);
+
+			writing = 1;
+			written++;
+			write_words = (last - first) / 4;
+			write_start = wait_now_us();
+		}
+
+		stats_record("phase.write_block", block_start_ns, current_size);
+
+		// Blank blocks are still checked, whatever the flash holds
+		prev_addr = addr;
+		prev_data = data;
+		prev_size = current_size;
+
+		data += current_size;
+		addr += current_size;
+		size -= current_size;
+	}
+
+	if (writing) {
+		err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_WRITE, wait_flash_write, write_words, write_start);
+		noerr_or_out(err);
+	}
+
+	if ((flags & TARGET_WRITE_VERIFY) && prev_data) {
+		err = check_block(ctx, prev_addr, prev_data, prev_size, &match);
+		noerr_or_out(err);
+
+		if (!match) {
+			bad_pages[prev_addr / TARGET_FLASH_PAGE_SIZE / 32] |= 1u << (prev_addr / TARGET_FLASH_PAGE_SIZE % 32);
+		}
+
+		err = target_txn_init(ctx, &txn);
+		noerr_or_out(err);
+
+		err = flash_bank(&txn, 0);
+		noerr_or_out(err);
+
+		err = target_txn_commit(&txn);
+		noerr_or_out(err);
+	}
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+err_t target_write_flash(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size, int flags)
+{
+	err_t err = err_failed;
+	const int npages = TARGET_FLASH_MAX_SIZE / TARGET_FLASH_PAGE_SIZE;
+	uint32_t bad_pages[TARGET_FLASH_MAX_SIZE / TARGET_FLASH_PAGE_SIZE / 32] = { 0 };
+
+	log_print("[Target] Write %dB to flash at 0x%05x\n", size, addr);
+	log_bytes(data, size);
+
+	if (size % 4 || addr % 4) {
+		error_out("Flash writing requires blocks of 4 bytes\n");
+	}
+	if (addr + size > TARGET_FLASH_MAX_SIZE) {
+		error_out("Flash writing beyond 0x%05x\n", TARGET_FLASH_MAX_SIZE);
+	}
+
+	err = write_flash(ctx, addr, data, size, flags, bad_pages);
 	noerr_or_out(err);
 
+	/*
+	 * A page is the smallest thing that can be written again, it's erased
+	 * first. What the range doesn't cover is read back beforehand and
+	 * written again with it, so earlier writes to the page survive.
+	 */
+	for (int page = 0; page < npages; page++) {
+		uint8_t page_data[TARGET_FLASH_PAGE_SIZE];
+		const uint8_t *rewrite = NULL;
+
+		for (int retry = 1; bad_pages[page / 32] & 1u << (page % 32); retry++) {
+			uint32_t page_addr = (uint32_t)page * TARGET_FLASH_PAGE_SIZE;
+			uint32_t start = page_addr;
+			uint32_t end = page_addr + TARGET_FLASH_PAGE_SIZE;
+
+			if (retry > TARGET_WRITE_RETRIES) {
+				err = err_failed;
+				error_out("Flashing failed: checksum mismatch in page %d\n", page);
+			}
+
+			bad_pages[page / 32] &= ~(1u << (page % 32));
+
+			if (start < addr) {
+				start = addr;
+			}
+			if (end > addr + size) {
+				end = addr + size;
+			}
+
+			// Only the range was written, the rest of the page is intact
+			if (!rewrite && end - start == TARGET_FLASH_PAGE_SIZE) {
+				rewrite = data + (start - addr);
+			}
+			else if (!rewrite) {
+				err = target_read_code(ctx, page_addr, page_data, sizeof(page_data));
+				noerr_or_out(err);
+
+				memcpy(page_data + (start - page_addr), data + (start - addr), end - start);
+				rewrite = page_data;
+			}
+
+			log_print("[Target] Rewrite flash page %d (try %d)\n", page, retry);
+
+			err = write_flash(ctx, page_addr, rewrite, TARGET_FLASH_PAGE_SIZE,
+				TARGET_WRITE_ERASE | TARGET_WRITE_VERIFY, bad_pages);
+			noerr_or_out(err);
+		}
+	}
+
+out:
+	return err;
+}
+
+err_t target_verify_flash(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
+	int total_size = size;
+	const uint16_t seed = 0xffff;
+	const uint16_t temp_config_addr = 0x0820;
+	const int chunk_size = 4096;
+	dma_config_t dma_config;
+	target_txn_t txn = { .cmd_size = 0 };
+	uint8_t crc16_bytes[2];
+	uint16_t crc16_target;
+	uint16_t crc16_host;
+
+	log_print("[Target] Verify %dB of flash at 0x%05x\n", size, addr);
+
+	dma_config_init(ctx, &dma_config);
+
 	crc16_host = compute_crc16(data, size, seed);
 
+	/*
+	 * Only one bank is visible through the flash window, the RNG is seeded
+	 * once and keeps accumulating the CRC while the banks are walked.
+	 */
+	for (int first = 1; size; first = 0) {
+		int bank = addr / TARGET_FLASH_BANK_SIZE;
+		uint16_t offset = addr % TARGET_FLASH_BANK_SIZE;
+		int current_size = size;
+
+		if (current_size > chunk_size) {
+			current_size = chunk_size;
+		}
+		if (offset + current_size > TARGET_FLASH_BANK_SIZE) {
+			current_size = TARGET_FLASH_BANK_SIZE - offset;
+		}
+
+		// DMA from flash to RNG
+		err = dma_config_channel(
+			ctx, &dma_config, 0,
+			XDATA_FLASH + offset, 1, RNG_DATA_HIGH, 0,
+			current_size, 0, DMA_TMODE_BLOCK);
+		noerr_or_out(err);
+
+		err = target_txn_init(ctx, &txn);
+		noerr_or_out(err);
+
+		if (first) {
+			err = rng_seed(&txn, seed);
+			noerr_or_out(err);
+		}
+
+		err = flash_bank(&txn, bank);
+		noerr_or_out(err);
+
+		err = dma_config_commit(&txn, &dma_config, temp_config_addr);
+		noerr_or_out(err);
+
+		err = dma_arm(&txn, 0);
+		noerr_or_out(err);
+
+		err = dma_request(&txn, 0);
+		noerr_or_out(err);
+
+		err = target_txn_commit(&txn);
+		noerr_or_out(err);
+
+		err = dma_wait_completion(ctx, 0, current_size, wait_now_us());
+		noerr_or_out(err);
+
+		addr += current_size;
+		size -= current_size;
+	}
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = flash_bank(&txn, 0);
+	noerr_or_out(err);
+
+	err = rng_get_crc16(&txn, crc16_bytes);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+	crc16_target = crc16_bytes[0] | crc16_bytes[1] << 8;
+
 	if (crc16_host != crc16_target) {
 		err = err_failed;
 		error_out("Flashing failed: checksum mismatch (0x%04x != 0x%04x)\n", crc16_host, crc16_target);
 	}
 
+	stats_record("phase.verify", start_ns, total_size);
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+err_t target_erase_page(ccd_ctx_t *ctx, int page)
+{
+	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
+	target_txn_t txn = { .cmd_size = 0 };
+	uint64_t start;
+
+	log_print("[Target] Erase flash page %d\n", page);
+
+	err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_BUSY, wait_page_erase, 0, wait_now_us());
+	noerr_or_out(err);
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = flash_setup(&txn, (uint32_t)page * TARGET_FLASH_PAGE_SIZE);
+	noerr_or_out(err);
+
+	err = flag_set(&txn, FLASH_CONTROL, FLASH_ERASE);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+	start = wait_now_us();
+
+	err = flag_wait_cleared(ctx, FLASH_CONTROL, FLASH_BUSY | FLASH_ERASE, wait_page_erase, 1, start);
+	noerr_or_out(err);
+
+	stats_record("phase.erase_page", start_ns, TARGET_FLASH_PAGE_SIZE);
+
+out:
+	target_txn_abort(&txn);
+	return err;
+}
+
+err_t target_read_page_crcs(ccd_ctx_t *ctx, int first_page, int count, uint16_t *crcs)
+{
+	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
+	const uint16_t seed = 0xffff;
+	const uint16_t temp_config_addr = 0x0820;
+	const int pages_per_bank = TARGET_FLASH_BANK_SIZE / TARGET_FLASH_PAGE_SIZE;
+	dma_config_t dma_config;
+	target_txn_t txn = { .cmd_size = 0 };
+
+	log_print("[Target] Read CRC of %d flash pages from page %d\n", count, first_page);
+
+	dma_config_init(ctx, &dma_config);
+
+	// DMA from flash to RNG, a page never crosses a bank
+	err = dma_config_channel(
+		ctx, &dma_config, 0,
+		XDATA_FLASH, 1, RNG_DATA_HIGH, 0,
+		TARGET_FLASH_PAGE_SIZE, 0, DMA_TMODE_BLOCK);
+	noerr_or_out(err);
+
+	for (int i = 0; i < count; i++) {
+		int page = first_page + i;
+		uint16_t src = XDATA_FLASH + (page % pages_per_bank) * TARGET_FLASH_PAGE_SIZE;
+
+		err = target_txn_init(ctx, &txn);
+		noerr_or_out(err);
+
+		if (i == 0 || page % pages_per_bank == 0) {
+			err = flash_bank(&txn, page / pages_per_bank);
+			noerr_or_out(err);
+		}
+
+		// Only the source address changes from one page to the next
+		dma_config.configs[0][0] = src >> 8;
+		dma_config.configs[0][1] = src & 0xff;
+		err = dma_config_commit(&txn, &dma_config, temp_config_addr);
+		noerr_or_out(err);
+
+		err = rng_seed(&txn, seed);
+		noerr_or_out(err);
+
+		err = dma_arm(&txn, 0);
+		noerr_or_out(err);
+
+		err = dma_request(&txn, 0);
+		noerr_or_out(err);
+
+		err = target_txn_commit(&txn);
+		noerr_or_out(err);
+
+		err = rng_wait_crc16(ctx, TARGET_FLASH_PAGE_SIZE, wait_now_us(), &crcs[i]);
+		noerr_or_out(err);
+	}
+
+	err = target_txn_init(ctx, &txn);
+	noerr_or_out(err);
+
+	err = flash_bank(&txn, 0);
+	noerr_or_out(err);
+
+	err = target_txn_commit(&txn);
+	noerr_or_out(err);
+
+	stats_record("phase.page_crcs", start_ns, count * TARGET_FLASH_PAGE_SIZE);
+
 out:
+	target_txn_abort(&txn);
 	return err;
 }
@@ -54,6 +54,17 @@ enum {
 	XDATA_FLASH      = 0x8000,
 };
 
+enum {
+	MEMORY_CONTROL_BANK = 0x07,
+};
+
+enum {
+	TARGET_FLASH_PAGE_SIZE = 2048,
+	TARGET_FLASH_BANK_SIZE = 0x8000,
+	TARGET_FLASH_MAX_SIZE  = 1 << 18,
+	TARGET_FLASH_PAGES     = TARGET_FLASH_MAX_SIZE / TARGET_FLASH_PAGE_SIZE,
+};
+
 enum {
 	FLASH_BUSY  = 0x80,
 	FLASH_FULL  = 0x40,
@@ -132,13 +143,60 @@ err_t target_write_config(ccd_ctx_t *ctx, uint8_t config);
 err_t target_read_status(ccd_ctx_t *ctx, uint8_t *status);
 err_t target_erase(ccd_ctx_t *ctx);
 
-err_t target_command_add(void **cmd, int *size, void *data, int data_size);
-err_t target_command_init(void **cmd, int *size);
-err_t target_command_finalize(void **cmd, int *size);
+enum {
+	TARGET_CMD_CAPACITY   = 4096,
+	TARGET_TXN_MAX_READS  = 16,
+	TARGET_TXN_MAX_READ   = 1024,
+	TARGET_BURST_MIN_SIZE = 32, // Smaller xdata writes are done by instructions
+};
+
+/**
+ * Batch of xdata accesses sent as a single debug command.
+ * The command is built in the context's arena, so only one transaction
+ * can be open at a time on a context.
+ * Reads are deferred: their buffers are filled by target_txn_commit().
+ * target_txn_submit() doesn't wait at all, its single read is filled in
+ * once the usb queue is flushed.
+ */
+typedef struct {
+	ccd_ctx_t *ctx;
+	int cmd_size;
+	int last_read;
+	int read_size;
+	int nreads;
+	struct {
+		uint8_t *data;
+		int size;
+	} reads[TARGET_TXN_MAX_READS];
+} target_txn_t;
+
+err_t target_command_reserve(ccd_ctx_t *ctx, int size);
+
+err_t target_txn_init(ccd_ctx_t *ctx, target_txn_t *txn);
+err_t target_txn_read(target_txn_t *txn, uint16_t addr, uint8_t *data, int size);
+err_t target_txn_write(target_txn_t *txn, uint16_t addr, const uint8_t *data, int size);
+err_t target_txn_write_byte(target_txn_t *txn, uint16_t addr, uint8_t val);
+err_t target_txn_set_bits(target_txn_t *txn, uint16_t addr, uint8_t bits);
+err_t target_txn_commit(target_txn_t *txn);
+err_t target_txn_submit(target_txn_t *txn);
+void target_txn_abort(target_txn_t *txn);
 
 err_t target_read_xdata(ccd_ctx_t *ctx, uint16_t addr, uint8_t *data, int size);
+/**
+ * Large writes to SRAM are burst through DMA channel 0. Its descriptor in
+ * SRAM and its address register are restored afterwards.
+ */
 err_t target_write_xdata(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size);
-err_t target_write_flash(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size);
-err_t target_verify_flash(ccd_ctx_t *ctx, uint16_t addr, const uint8_t *data, int size);
+err_t target_read_code(ccd_ctx_t *ctx, uint32_t addr, uint8_t *data, int size);
+enum {
+	TARGET_WRITE_ERASE  = 0x01, // Erase each page before its first write
+	TARGET_WRITE_VERIFY = 0x02, // Check each block, rewrite the pages that fail
+	TARGET_WRITE_RETRIES = 3,
+};
+
+err_t target_write_flash(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size, int flags);
+err_t target_verify_flash(ccd_ctx_t *ctx, uint32_t addr, const uint8_t *data, int size);
+err_t target_erase_page(ccd_ctx_t *ctx, int page);
+err_t target_read_page_crcs(ccd_ctx_t *ctx, int first_page, int count, uint16_t *crcs);
 
 #endif
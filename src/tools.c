@@ -21,36 +21,214 @@
  * THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
 #include "tools.h"
 
-static int _log_enabled = 0;
+log_level_t log_level = log_off;
+
+/*
+ * Log lines go through a ring of fixed slots, filled by any thread and
+ * emptied by a single drain thread. A slot's sequence number tells whose
+ * turn it is: pos while free for the writer claiming position pos, pos + 1
+ * once written, pos + log_slots once drained.
+ */
+enum {
+	log_slots     = 1024,
+	log_slot_size = 256,
+	log_idle_us   = 1000,
+};
+
+typedef struct {
+	_Atomic uint64_t seq;
+	int size;
+	char text[log_slot_size - sizeof(uint64_t) - sizeof(int)];
+} log_slot_t;
+
+static log_slot_t log_ring[log_slots];
+static _Atomic uint64_t log_head;
+static _Atomic uint64_t log_tail;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static _Atomic int log_started;
 
-void log_set(int enable_log)
+static void *log_drain(void *arg)
 {
-	_log_enabled = enable_log;
+	char buffer[16 * 1024];
+	uint64_t tail = atomic_load(&log_tail);
+	(void)arg;
+
+	while (1) {
+		int size = 0;
+
+		// Gather what is ready, write it in one go
+		while (size + (int)sizeof(log_ring[0].text) <= (int)sizeof(buffer)) {
+			log_slot_t *slot = &log_ring[tail % log_slots];
+
+			if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1) {
+				break;
+			}
+
+			memcpy(buffer + size, slot->text, slot->size);
+			size += slot->size;
+
+			atomic_store_explicit(&slot->seq, tail + log_slots, memory_order_release);
+			tail++;
+		}
+
+		if (size) {
+			fwrite(buffer, 1, size, stderr);
+		}
+		else {
+			fflush(stderr);
+			usleep(log_idle_us);
+		}
+
+		atomic_store_explicit(&log_tail, tail, memory_order_release);
+	}
+
+	return NULL;
 }
 
-void log_print(const char *format, ...)
+static void log_start(void)
+{
+	pthread_t thread;
+
+	for (uint64_t i = 0; i < log_slots; i++) {
+		atomic_init(&log_ring[i].seq, i);
+	}
+
+	if (pthread_create(&thread, NULL, log_drain, NULL)) {
+		fprintf(stderr, "Can't start log thread\n");
+		return;
+	}
+	pthread_detach(thread);
+
+	atexit(log_flush);
+	atomic_store(&log_started, 1);
+}
+
+static void log_push(const char *text, int size)
+{
+	const int slot_text = sizeof(log_ring[0].text);
+	uint64_t pos;
+
+	if (!atomic_load_explicit(&log_started, memory_order_acquire)) {
+		pthread_once(&log_once, log_start);
+	}
+
+	// Without the thread, lines are written right away
+	if (!atomic_load_explicit(&log_started, memory_order_acquire)) {
+		fwrite(text, 1, size, stderr);
+		return;
+	}
+
+	// A long message takes consecutive slots, claimed at once so that
+	// other threads can't slip a line in the middle of it
+	pos = atomic_fetch_add(&log_head, (size + slot_text - 1) / slot_text);
+
+	for (; size; pos++) {
+		log_slot_t *slot = &log_ring[pos % log_slots];
+		int chunk = size > slot_text ? slot_text : size;
+
+		// The ring is full, wait for the drain thread to catch up
+		while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+			usleep(10);
+		}
+
+		memcpy(slot->text, text, chunk);
+		slot->size = chunk;
+		atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+		text += chunk;
+		size -= chunk;
+	}
+}
+
+static _Thread_local char error_text[256];
+
+void error_write(const char *format, ...)
 {
 	va_list args;
+	va_list copy;
+
 	va_start(args, format);
+	va_copy(copy, args);
+	vsnprintf(error_text, sizeof(error_text), format, copy);
+	vfprintf(stderr, format, args);
+	va_end(copy);
+	va_end(args);
+}
 
-	if (_log_enabled) {
-		vfprintf(stderr, format, args);
-	}
+const char *error_last(void)
+{
+	return error_text;
+}
+
+void error_clear(void)
+{
+	error_text[0] = '\0';
+}
+
+void log_set(log_level_t level)
+{
+	log_level = level;
+}
 
+void log_write(const char *format, ...)
+{
+	char text[1024];
+	va_list args;
+	int size;
+
+	va_start(args, format);
+	size = vsnprintf(text, sizeof(text), format, args);
 	va_end(args);
+
+	if (size > (int)sizeof(text) - 1) {
+		size = sizeof(text) - 1;
+	}
+	if (size > 0) {
+		log_push(text, size);
+	}
 }
 
-void log_bytes(const uint8_t *data, int size)
+void log_write_bytes(const uint8_t *data, int size)
 {
-	for (int i = 0; i < size; i ++) {
-		 log_print("%02x ", data[i]);
-		if ((i+1) % 16 == 0) {
-			 log_print("\n");
+	static const char digits[] = "0123456789abcdef";
+	char text[sizeof(log_ring[0].text)];
+	int len = 0;
+
+	// Lines of 16 bytes, as many as fit in a slot
+	for (int i = 0; i < size; i++) {
+		text[len++] = digits[data[i] >> 4];
+		text[len++] = digits[data[i] & 0xf];
+		text[len++] = ' ';
+
+		if ((i + 1) % 16 == 0 || i + 1 == size) {
+			text[len++] = '\n';
+
+			if (len + 16 * 3 + 1 > (int)sizeof(text) || i + 1 == size) {
+				log_push(text, len);
+				len = 0;
+			}
 		}
 	}
-	if (size > 0 && size % 16 != 0) {
-		 log_print("\n");
+}
+
+void log_flush(void)
+{
+	uint64_t head;
+
+	if (!atomic_load_explicit(&log_started, memory_order_acquire)) {
+		return;
+	}
+
+	head = atomic_load(&log_head);
+	while (atomic_load_explicit(&log_tail, memory_order_acquire) < head) {
+		usleep(100);
 	}
+
+	fflush(stderr);
 }
@@ -26,21 +26,41 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-typedef enum {
-	err_none   = 0,
-	err_failed = 1,
-	err_oom    = 2,
-} err_t;
+#include "libccd.h"
 
+// Short names of the libccd.h types, used throughout the sources
+typedef ccd_err_t err_t;
+#define err_none   ccd_err_none
+#define err_failed ccd_err_failed
+#define err_oom    ccd_err_oom
+
+typedef ccd_log_level_t log_level_t;
+#define log_off   ccd_log_off
+#define log_debug ccd_log_debug
+#define log_trace ccd_log_trace
+#define log_set   ccd_log_set
+#define log_flush ccd_log_flush
+
+// Pending log lines go out first, so the error comes after what led to it
 #define error_out(...) \
 	do { \
-		fprintf(stderr, __VA_ARGS__); \
+		log_flush(); \
+		error_write(__VA_ARGS__); \
 		goto out; \
 	} while (0)
 
+/*
+ * Errors are written to stderr, the last one of each thread is also kept
+ * to be reported elsewhere. error_last() is empty after error_clear().
+ */
+void error_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+const char *error_last(void);
+void error_clear(void);
+
 #define noerr_or_out(cond) \
 	do { \
 		if ((cond)) { \
@@ -48,8 +68,38 @@ typedef enum {
 		} \
 	} while (0)
 
-void log_set(int enable_log);
-void log_print(const char *format, ...);
-void log_bytes(const uint8_t *data, int size);
+/*
+ * Levels above LOG_LEVEL_MAX are compiled out, -DLOG_LEVEL_MAX=log_off
+ * builds a binary without any logging.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX log_trace
+#endif
+
+extern log_level_t log_level;
+
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_write_bytes(const uint8_t *data, int size);
+
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+/*
+ * Disabled levels cost a compare, arguments aren't even evaluated.
+ * Enabled ones are formatted by the caller and written out by a
+ * background thread.
+ */
+#define log_print(...) \
+	do { \
+		if (log_enabled(log_debug)) { \
+			log_write(__VA_ARGS__); \
+		} \
+	} while (0)
+
+static inline void log_bytes(const uint8_t *data, int size)
+{
+	if (log_enabled(log_trace)) {
+		log_write_bytes(data, size);
+	}
+}
 
 #endif
@@ -21,81 +21,116 @@
  * THE SOFTWARE.
  */
 
-#include <libusb-1.0/libusb.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "usb.h"
+#include "stats.h"
+#include "usb_backend.h"
+
+// Bulk transfer timed from submission to completion
+typedef struct {
+	uint64_t start_ns;
+	usb_endpoint_t endpoint;
+	int size;
+	usb_callback_t callback;
+	void *user;
+} usb_timed_t;
 
 struct usb_ctx_t {
-	libusb_context *context;
-	libusb_device **devices;
-	libusb_device *device;
-	libusb_device_handle *device_handle;
+	const usb_transport_t *transport;
+	void *backend;
+
+	/*
+	 * Timings of the bulk transfers in flight while stats are enabled.
+	 * Entries are reused once a flush has completed all of them.
+	 */
+	usb_timed_t **timed;
+	int ntimed;
+	int timed_capacity;
 };
 
-usb_ctx_t *usb_open_device(int vendor_id, int product_id)
-{
-	usb_ctx_t *ctx = NULL;
-	int ret;
-	int err = 1;
-	ssize_t usb_devcnt;
+// Plain libusb, for callers without a config
+static const ccd_config_t usb_default_config = { .sim_options = NULL };
 
-	ctx = malloc(sizeof(*ctx));
-	if (!ctx) {
-		error_out("Can't allocate memory\n");
+// Device 0 uses the file as given, the others in gang mode get an index suffix
+static void trace_path(char *path, int size, const char *file, int index)
+{
+	if (index) {
+		snprintf(path, size, "%s.%d", file, index);
 	}
+	else {
+		snprintf(path, size, "%s", file);
+	}
+}
 
-	ctx->context = NULL;
-	ctx->device = NULL;
-	ctx->device_handle = NULL;
-	ctx->devices = NULL;
-
-	log_print("[USB] Opening connection\n");
+int usb_count_devices(const ccd_config_t *config, int vendor_id, int product_id)
+{
+	char path[4096];
+	int count = 0;
 
-	ret = libusb_init(&ctx->context);
-	if (ret) {
-		error_out("Can't init usb stack: %s\n", libusb_error_name(ret));
+	if (!config) {
+		config = &usb_default_config;
 	}
 
-	usb_devcnt = libusb_get_device_list(ctx->context, &ctx->devices);
-	if (usb_devcnt < 0) {
-		error_out("Can't get device list: %s\n", libusb_error_name(usb_devcnt));
+	if (config->sim_options && !config->replay_file) {
+		return usb_sim_count(config->sim_options);
+	}
+	if (!config->replay_file) {
+		return usb_libusb_count(vendor_id, product_id);
 	}
 
-	for (int i = 0; i < usb_devcnt; i++) {
-		struct libusb_device_descriptor usb_descriptor;
-
-		ret = libusb_get_device_descriptor(ctx->devices[i], &usb_descriptor);
-		if (ret) {
-			error_out("Can't get usb descriptor: %s\n", libusb_error_name(ret));
-		}
-
-		if (usb_descriptor.idVendor == vendor_id &&
-		    usb_descriptor.idProduct == product_id) {
-			ctx->device = ctx->devices[i];
+	for (;;) {
+		trace_path(path, sizeof(path), config->replay_file, count);
+		if (access(path, R_OK)) {
 			break;
 		}
+		count++;
 	}
 
-	if (!ctx->device) {
-		error_out("Can't find device\n");
+	return count;
+}
+
+usb_ctx_t *usb_open_device(const ccd_config_t *config, int vendor_id, int product_id, int index)
+{
+	usb_ctx_t *ctx = NULL;
+	char path[4096];
+	void *inner;
+	const usb_transport_t *inner_transport;
+	int err = 1;
+
+	if (!config) {
+		config = &usb_default_config;
 	}
 
-	ret = libusb_open(ctx->device, &ctx->device_handle);
-	if (ret) {
-		error_out("Can't grab device handle: %s\n", libusb_error_name(ret));
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
 	}
 
-	if (libusb_kernel_driver_active(ctx->device_handle, 0) == 1) {
-		ret = libusb_detach_kernel_driver(ctx->device_handle, 0);
-		if (ret) {
-			error_out("Can't detach kernel: %s\n", libusb_error_name(ret));
-		}
+	if (config->replay_file) {
+		trace_path(path, sizeof(path), config->replay_file, index);
+		ctx->backend = usb_replay_open(path, config->replay_timing, &ctx->transport);
+	}
+	else if (config->sim_options) {
+		ctx->backend = usb_sim_open(config->sim_options, index, &ctx->transport);
 	}
+	else {
+		ctx->backend = usb_libusb_open(vendor_id, product_id, index, &ctx->transport);
+	}
+	if (!ctx->backend) {
+		goto out;
+	}
+
+	if (config->record_file) {
+		inner = ctx->backend;
+		inner_transport = ctx->transport;
 
-	ret = libusb_claim_interface(ctx->device_handle, 0);
-	if (ret) {
-		error_out("Can't claim interface: %s\n", libusb_error_name(ret));
+		trace_path(path, sizeof(path), config->record_file, index);
+		ctx->backend = usb_record_open(path, inner, inner_transport, &ctx->transport);
+		if (!ctx->backend) {
+			inner_transport->close(inner);
+			goto out;
+		}
 	}
 
 	err = 0;
@@ -108,82 +143,156 @@ out:
 	return ctx;
 }
 
-void usb_close_device(usb_ctx_t *ctx)
+usb_ctx_t *usb_open_transport(void *backend, const usb_transport_t *transport)
 {
-	log_print("[USB] Closing connection\n");
+	usb_ctx_t *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
+	}
+
+	ctx->backend = backend;
+	ctx->transport = transport;
+
+out:
+	return ctx;
+}
 
+void usb_close_device(usb_ctx_t *ctx)
+{
 	if (ctx) {
-		if (ctx->device_handle) {
-			libusb_release_interface(ctx->device_handle, 0);
-			libusb_close(ctx->device_handle);
-		}
-		if (ctx->devices) {
-			libusb_free_device_list(ctx->devices, 0);
+		ctx->transport->close(ctx->backend);
+		for (int i = 0; i < ctx->timed_capacity; i++) {
+			free(ctx->timed[i]);
 		}
-		if (ctx->context) {
-			libusb_exit(ctx->context);
-		}
-
+		free(ctx->timed);
 		free(ctx);
 	}
 }
 
-
 err_t usb_control_transfer(
 	usb_ctx_t *ctx, usb_endpoint_t endpoint,
 	int request, int value, int index, void *data, int size)
 {
-	err_t err = err_failed;
-	int ret;
+	err_t err;
+	uint64_t start_ns;
+	char name[32];
 
-	log_print("[USB] Control Transfer <%s> %dB req=0x%02x <val=0x%02x, idx=0x%02x>\n", 
-		endpoint == USB_IN ? "in" : "out", 
-		size, request, value, index);
+	// Control requests must not overtake queued bulk commands
+	err = usb_flush(ctx);
+	noerr_or_out(err);
 
-	ret = libusb_control_transfer(
-		ctx->device_handle,
-		((endpoint == USB_IN) ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT) | LIBUSB_REQUEST_TYPE_VENDOR,
-		request,
-		value, index, (unsigned char *)data, size, 1000);
-	if (ret < 0 || ret != size) {
-		error_out("Control transfer failed: %s\n", libusb_error_name(ret));
-	}
+	start_ns = stats_begin();
 
-	log_bytes(data, size);
-	
-	err = err_none;
+	err = ctx->transport->control(ctx->backend, endpoint, request, value, index, data, size);
+	noerr_or_out(err);
+
+	if (start_ns) {
+		snprintf(name, sizeof(name), "usb.control.%s.0x%02x",
+			endpoint == USB_IN ? "in" : "out", request);
+		stats_record(name, start_ns, size);
+	}
 
 out:
 	return err;
 }
 
-err_t usb_bulk_transfer(
-	usb_ctx_t *ctx, usb_endpoint_t endpoint, void *data, int size)
+static void usb_timed_done(void *user, err_t err)
 {
-	const int bulk_endpoint = 0x4;
+	usb_timed_t *timed = user;
 
-	err_t err = err_failed;
-	int ret;
-	int transferred;
+	// Submission to completion, time spent queued by the backend included
+	if (!err) {
+		stats_record(timed->endpoint == USB_IN ? "usb.bulk.in" : "usb.bulk.out",
+			timed->start_ns, timed->size);
+	}
+
+	if (timed->callback) {
+		timed->callback(timed->user, err);
+	}
+}
+
+static usb_timed_t *usb_timed_get(usb_ctx_t *ctx)
+{
+	usb_timed_t **timed;
+	int capacity;
+
+	if (ctx->ntimed == ctx->timed_capacity) {
+		capacity = ctx->timed_capacity * 2 + 16;
+
+		timed = realloc(ctx->timed, capacity * sizeof(*timed));
+		if (!timed) {
+			return NULL;
+		}
+		ctx->timed = timed;
+
+		for (; ctx->timed_capacity < capacity; ctx->timed_capacity++) {
+			ctx->timed[ctx->timed_capacity] = malloc(sizeof(usb_timed_t));
+			if (!ctx->timed[ctx->timed_capacity]) {
+				return NULL;
+			}
+		}
+	}
+
+	return ctx->timed[ctx->ntimed++];
+}
 
-	log_print("[USB] Bulk Transfer <%s> %dB\n",
-		endpoint == USB_IN ? "in" : "out",
-		size);
+err_t usb_bulk_submit(
+	usb_ctx_t *ctx, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	err_t err = err_failed;
+	uint64_t start_ns = stats_begin();
+	usb_timed_t *timed;
 
-	ret = libusb_bulk_transfer(
-		ctx->device_handle,
-		((endpoint == USB_IN) ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT) | bulk_endpoint,
-		(unsigned char *)data, size, &transferred, 1000);
-	if (ret < 0) {
-		error_out("Bulk transfer failed: %s\n", libusb_error_name(ret));
+	if (!start_ns) {
+		return ctx->transport->submit(ctx->backend, endpoint, data, size, callback, user);
 	}
-	if (transferred != size) {
-		error_out("Bulk transfer failer: transferred %dB instead of %dB\n", transferred, size);
+
+	timed = usb_timed_get(ctx);
+	if (!timed) {
+		err = err_oom;
+		error_out("Can't allocate memory\n");
 	}
 
-	log_bytes(data, size);
+	timed->start_ns = start_ns;
+	timed->endpoint = endpoint;
+	timed->size = size;
+	timed->callback = callback;
+	timed->user = user;
+
+	err = ctx->transport->submit(ctx->backend, endpoint, data, size, usb_timed_done, timed);
+	noerr_or_out(err);
+
+out:
+	return err;
+}
+
+err_t usb_flush(usb_ctx_t *ctx)
+{
+	err_t err;
+
+	err = ctx->transport->flush(ctx->backend);
+	noerr_or_out(err);
+
+	// Everything submitted has completed, timings can be reused
+	ctx->ntimed = 0;
+
+out:
+	return err;
+}
+
+err_t usb_bulk_transfer(
+	usb_ctx_t *ctx, usb_endpoint_t endpoint, void *data, int size)
+{
+	err_t err;
+
+	err = usb_bulk_submit(ctx, endpoint, data, size, NULL, NULL);
+	noerr_or_out(err);
 
-	err = err_none;
+	err = usb_flush(ctx);
+	noerr_or_out(err);
 
 out:
 	return err;
@@ -44,7 +44,16 @@ typedef enum {
 
 typedef struct usb_ctx_t usb_ctx_t;
 
-usb_ctx_t *usb_open_device(int vendor_id, int product_id);
+typedef void (*usb_callback_t)(void *user, err_t err);
+
+/**
+ * The config selects the transport, NULL for libusb. Recording tees every
+ * transfer to a trace file, replay serves a trace instead of a device and
+ * the simulator stands in for a debugger and its target.
+ * Recording can be combined with either of the others.
+ */
+int usb_count_devices(const ccd_config_t *config, int vendor_id, int product_id);
+usb_ctx_t *usb_open_device(const ccd_config_t *config, int vendor_id, int product_id, int index);
 void usb_close_device(usb_ctx_t *ctx);
 
 err_t usb_control_transfer(
@@ -54,4 +63,14 @@ err_t usb_control_transfer(
 err_t usb_bulk_transfer(
 	usb_ctx_t *ctx, usb_endpoint_t endpoint, void *data, int size);
 
+/**
+ * Queue a bulk transfer without waiting for it to complete.
+ * OUT data is copied, IN data must stay valid until the callback or flush.
+ * Errors of queued transfers are reported by the next usb_flush().
+ */
+err_t usb_bulk_submit(
+	usb_ctx_t *ctx, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user);
+err_t usb_flush(usb_ctx_t *ctx);
+
 #endif
@@ -0,0 +1,73 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef USB_BACKEND_H
+#define USB_BACKEND_H
+
+#include "usb.h"
+
+/**
+ * Transport behind a usb_ctx_t. Control transfers are only issued once the
+ * bulk ring is flushed, backends don't need to order them themselves.
+ */
+typedef struct {
+	err_t (*control)(
+		void *backend, usb_endpoint_t endpoint,
+		int request, int value, int index, void *data, int size);
+	err_t (*submit)(
+		void *backend, usb_endpoint_t endpoint, void *data, int size,
+		usb_callback_t callback, void *user);
+	err_t (*flush)(void *backend);
+	void (*close)(void *backend);
+} usb_transport_t;
+
+/**
+ * Context for a backend of the caller's, closed with usb_close_device().
+ */
+usb_ctx_t *usb_open_transport(void *backend, const usb_transport_t *transport);
+
+extern const usb_transport_t usb_libusb_transport;
+
+int usb_libusb_count(int vendor_id, int product_id);
+void *usb_libusb_open(int vendor_id, int product_id, int index, const usb_transport_t **transport);
+
+/**
+ * Record every transfer going through the inner transport to a trace file.
+ */
+void *usb_record_open(
+	const char *file, void *inner, const usb_transport_t *inner_transport,
+	const usb_transport_t **transport);
+
+/**
+ * Serve the transfers of a trace file back. OUT data must match the trace,
+ * with timing set completions are delayed as they were when recorded.
+ */
+void *usb_replay_open(const char *file, int timing, const usb_transport_t **transport);
+
+/**
+ * Simulated CC-Debugger and CC2541, configured by comma separated options.
+ */
+int usb_sim_count(const char *options);
+void *usb_sim_open(const char *options, int index, const usb_transport_t **transport);
+
+#endif
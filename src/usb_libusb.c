@@ -0,0 +1,395 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <libusb-1.0/libusb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_backend.h"
+
+enum {
+	usb_timeout       = 1000,
+	usb_bulk_endpoint = 0x4,
+	usb_max_transfers = 16,
+};
+
+typedef struct usb_libusb_t usb_libusb_t;
+
+typedef struct {
+	usb_libusb_t *ctx;
+	struct libusb_transfer *transfer;
+	uint8_t *buffer;
+	int capacity;
+	usb_endpoint_t endpoint;
+	usb_callback_t callback;
+	void *user;
+	int in_flight;
+	int done;
+} usb_transfer_t;
+
+struct usb_libusb_t {
+	libusb_context *context;
+	libusb_device **devices;
+	libusb_device *device;
+	libusb_device_handle *device_handle;
+
+	// Ring of bulk transfers, completed in submission order
+	usb_transfer_t transfers[usb_max_transfers];
+	int head;
+	int pending;
+	err_t error;
+};
+
+static int device_matches(libusb_device *device, int vendor_id, int product_id)
+{
+	struct libusb_device_descriptor usb_descriptor;
+	int ret;
+
+	ret = libusb_get_device_descriptor(device, &usb_descriptor);
+	if (ret) {
+		fprintf(stderr, "Can't get usb descriptor: %s\n", libusb_error_name(ret));
+		return -1;
+	}
+
+	return usb_descriptor.idVendor == vendor_id &&
+	       usb_descriptor.idProduct == product_id;
+}
+
+int usb_libusb_count(int vendor_id, int product_id)
+{
+	libusb_context *context = NULL;
+	libusb_device **devices = NULL;
+	ssize_t usb_devcnt = 0;
+	int count = -1;
+	int ret;
+
+	ret = libusb_init(&context);
+	if (ret) {
+		error_out("Can't init usb stack: %s\n", libusb_error_name(ret));
+	}
+
+	usb_devcnt = libusb_get_device_list(context, &devices);
+	if (usb_devcnt < 0) {
+		error_out("Can't get device list: %s\n", libusb_error_name(usb_devcnt));
+	}
+
+	count = 0;
+	for (int i = 0; i < usb_devcnt; i++) {
+		ret = device_matches(devices[i], vendor_id, product_id);
+		if (ret < 0) {
+			count = -1;
+			goto out;
+		}
+		count += ret;
+	}
+
+out:
+	if (devices) {
+		libusb_free_device_list(devices, 1);
+	}
+	if (context) {
+		libusb_exit(context);
+	}
+	return count;
+}
+
+static void libusb_backend_close(void *backend);
+static err_t libusb_backend_flush(void *backend);
+
+void *usb_libusb_open(int vendor_id, int product_id, int index, const usb_transport_t **transport)
+{
+	usb_libusb_t *ctx = NULL;
+	int ret;
+	int err = 1;
+	ssize_t usb_devcnt;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
+	}
+
+	log_print("[USB] Opening connection to device %d\n", index);
+
+	// Every device gets its own usb context so they can live in different threads
+	ret = libusb_init(&ctx->context);
+	if (ret) {
+		error_out("Can't init usb stack: %s\n", libusb_error_name(ret));
+	}
+
+	usb_devcnt = libusb_get_device_list(ctx->context, &ctx->devices);
+	if (usb_devcnt < 0) {
+		error_out("Can't get device list: %s\n", libusb_error_name(usb_devcnt));
+	}
+
+	for (int i = 0; i < usb_devcnt; i++) {
+		ret = device_matches(ctx->devices[i], vendor_id, product_id);
+		if (ret < 0) {
+			goto out;
+		}
+
+		if (ret && index-- == 0) {
+			ctx->device = ctx->devices[i];
+			break;
+		}
+	}
+
+	if (!ctx->device) {
+		error_out("Can't find device\n");
+	}
+
+	ret = libusb_open(ctx->device, &ctx->device_handle);
+	if (ret) {
+		error_out("Can't grab device handle: %s\n", libusb_error_name(ret));
+	}
+
+	if (libusb_kernel_driver_active(ctx->device_handle, 0) == 1) {
+		ret = libusb_detach_kernel_driver(ctx->device_handle, 0);
+		if (ret) {
+			error_out("Can't detach kernel: %s\n", libusb_error_name(ret));
+		}
+	}
+
+	ret = libusb_claim_interface(ctx->device_handle, 0);
+	if (ret) {
+		error_out("Can't claim interface: %s\n", libusb_error_name(ret));
+	}
+
+	for (int i = 0; i < usb_max_transfers; i++) {
+		ctx->transfers[i].ctx = ctx;
+		ctx->transfers[i].transfer = libusb_alloc_transfer(0);
+		if (!ctx->transfers[i].transfer) {
+			error_out("Can't allocate usb transfer\n");
+		}
+	}
+
+	*transport = &usb_libusb_transport;
+	err = 0;
+
+out:
+	if (err) {
+		libusb_backend_close(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+static void libusb_backend_close(void *backend)
+{
+	usb_libusb_t *ctx = backend;
+
+	log_print("[USB] Closing connection\n");
+
+	if (ctx) {
+		if (ctx->pending) {
+			libusb_backend_flush(ctx);
+		}
+		for (int i = 0; i < usb_max_transfers; i++) {
+			if (ctx->transfers[i].transfer) {
+				libusb_free_transfer(ctx->transfers[i].transfer);
+			}
+			free(ctx->transfers[i].buffer);
+		}
+		if (ctx->device_handle) {
+			libusb_release_interface(ctx->device_handle, 0);
+			libusb_close(ctx->device_handle);
+		}
+		if (ctx->devices) {
+			libusb_free_device_list(ctx->devices, 0);
+		}
+		if (ctx->context) {
+			libusb_exit(ctx->context);
+		}
+
+		free(ctx);
+	}
+}
+
+static err_t transfer_wait(usb_transfer_t *xfer)
+{
+	err_t err = err_failed;
+	int ret;
+
+	while (!xfer->done) {
+		ret = libusb_handle_events_completed(xfer->ctx->context, &xfer->done);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			error_out("Can't handle usb events: %s\n", libusb_error_name(ret));
+		}
+	}
+
+	xfer->in_flight = 0;
+	err = err_none;
+
+out:
+	return err;
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer)
+{
+	usb_transfer_t *xfer = transfer->user_data;
+	usb_libusb_t *ctx = xfer->ctx;
+	err_t err = err_failed;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		error_out("Bulk transfer failed: status %d\n", transfer->status);
+	}
+	if (transfer->actual_length != transfer->length) {
+		error_out("Bulk transfer failed: transferred %dB instead of %dB\n",
+			transfer->actual_length, transfer->length);
+	}
+
+	if (xfer->endpoint == USB_IN) {
+		log_print("[USB] Bulk Transfer <in> %dB completed\n", transfer->length);
+		log_bytes(transfer->buffer, transfer->length);
+	}
+
+	err = err_none;
+
+out:
+	if (err && !ctx->error) {
+		ctx->error = err;
+	}
+	if (xfer->callback) {
+		xfer->callback(xfer->user, err);
+	}
+	ctx->pending--;
+	xfer->done = 1;
+}
+
+static err_t libusb_backend_submit(
+	void *backend, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	usb_libusb_t *ctx = backend;
+	err_t err = err_failed;
+	usb_transfer_t *xfer = &ctx->transfers[ctx->head];
+	uint8_t *buffer = data;
+	int ret;
+
+	log_print("[USB] Bulk Transfer <%s> %dB\n",
+		endpoint == USB_IN ? "in" : "out",
+		size);
+
+	// The ring is full: wait for the oldest transfer to complete
+	if (xfer->in_flight) {
+		err = transfer_wait(xfer);
+		noerr_or_out(err);
+	}
+
+	// OUT payloads are copied so the caller can reuse its buffer right away
+	if (endpoint == USB_OUT) {
+		if (size > xfer->capacity) {
+			buffer = realloc(xfer->buffer, size);
+			if (!buffer) {
+				err = err_oom;
+				error_out("Can't allocate memory\n");
+			}
+			xfer->buffer = buffer;
+			xfer->capacity = size;
+		}
+		buffer = xfer->buffer;
+		memcpy(buffer, data, size);
+		log_bytes(buffer, size);
+	}
+
+	xfer->endpoint = endpoint;
+	xfer->callback = callback;
+	xfer->user = user;
+	xfer->done = 0;
+
+	libusb_fill_bulk_transfer(
+		xfer->transfer, ctx->device_handle,
+		((endpoint == USB_IN) ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT) | usb_bulk_endpoint,
+		buffer, size, transfer_done, xfer, usb_timeout);
+
+	ret = libusb_submit_transfer(xfer->transfer);
+	if (ret < 0) {
+		error_out("Bulk transfer failed: %s\n", libusb_error_name(ret));
+	}
+
+	xfer->in_flight = 1;
+	ctx->pending++;
+	ctx->head = (ctx->head + 1) % usb_max_transfers;
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t libusb_backend_flush(void *backend)
+{
+	usb_libusb_t *ctx = backend;
+	err_t err = err_none;
+
+	// Oldest in-flight transfer sits right after the head of the ring
+	for (int i = 0; i < usb_max_transfers && ctx->pending; i++) {
+		usb_transfer_t *xfer = &ctx->transfers[(ctx->head + i) % usb_max_transfers];
+
+		if (xfer->in_flight) {
+			err = transfer_wait(xfer);
+			noerr_or_out(err);
+		}
+	}
+
+	err = ctx->error;
+	ctx->error = err_none;
+
+out:
+	return err;
+}
+
+static err_t libusb_backend_control(
+	void *backend, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	usb_libusb_t *ctx = backend;
+	err_t err = err_failed;
+	int ret;
+
+	log_print("[USB] Control Transfer <%s> %dB req=0x%02x <val=0x%02x, idx=0x%02x>\n", 
+		endpoint == USB_IN ? "in" : "out", 
+		size, request, value, index);
+
+	ret = libusb_control_transfer(
+		ctx->device_handle,
+		((endpoint == USB_IN) ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT) | LIBUSB_REQUEST_TYPE_VENDOR,
+		request,
+		value, index, (unsigned char *)data, size, usb_timeout);
+	if (ret < 0 || ret != size) {
+		error_out("Control transfer failed: %s\n", libusb_error_name(ret));
+	}
+
+	log_bytes(data, size);
+	
+	err = err_none;
+
+out:
+	return err;
+}
+
+const usb_transport_t usb_libusb_transport = {
+	.control = libusb_backend_control,
+	.submit  = libusb_backend_submit,
+	.flush   = libusb_backend_flush,
+	.close   = libusb_backend_close,
+};
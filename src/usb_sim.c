@@ -0,0 +1,926 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "crc.h"
+#include "target.h"
+#include "usb_backend.h"
+#include "wait.h"
+
+/*
+ * Software CC-Debugger with a CC2541 behind it. It understands the
+ * commands target.c sends: debug instructions wrapped in the fixed
+ * header and footer, bursts, config and status, chip erase. xdata, the
+ * flash controller, the DMA channels and the RNG CRC are modelled well
+ * enough for every flashing, verify and dump path.
+ *
+ * Operations complete at once, their status bits only clear once the
+ * configured time is elapsed, as a host polling the real part sees it.
+ */
+
+enum {
+	sim_dma_channels = 5,
+	sim_sram_size    = 0x2000,
+	sim_chip_id      = 0x41,
+	sim_chip_version = 0x11,
+	// 256 KB flash, 8 KB SRAM
+	sim_chip_info    = 0x0740,
+};
+
+// Saves A, DPS and DPTR in debugger registers, restored by the footer
+static const uint8_t sim_cmd_header[] = {
+	0x40, 0x55, 0x00, 0x72, 0x56, 0xe5, 0x92, 0xbe,
+	0x57, 0x75, 0x92, 0x00, 0x74, 0x56, 0xe5, 0x83,
+	0x76, 0x56, 0xe5, 0x82
+};
+
+static const uint8_t sim_cmd_footer[] = {
+	0xd4, 0x57, 0x90, 0xc2, 0x57, 0x75, 0x92, 0x90,
+	0x56, 0x74
+};
+
+typedef struct {
+	uint32_t latency_us;    // Per transfer
+	uint32_t byte_ns;       // Per byte on the bus
+	uint32_t write_ns;      // Per flash word
+	uint32_t erase_us;      // Per flash page
+	uint32_t chip_erase_us;
+	uint32_t dma_ns;        // Per byte
+	int devices;
+	int locked;
+	int weak_page;          // Loses its first write, until erased again
+	char *image;            // Initial flash content
+} sim_config_t;
+
+typedef struct {
+	int armed;
+	int finished;
+	uint64_t done_us;
+	uint16_t src;
+	uint16_t dst;
+	int src_inc;
+	int dst_inc;
+	int len;
+	int count;
+	uint8_t trigger;
+	uint8_t tmode;
+} sim_dma_t;
+
+typedef struct {
+	sim_config_t config;
+
+	// Debugger
+	int debug;
+	uint64_t due_us;
+	int burst_size;
+	uint8_t *in;
+	int in_size;
+	int in_capacity;
+
+	// Target
+	uint8_t config_reg;
+	uint64_t chip_erase_us;
+	uint16_t dptr;
+	uint8_t a;
+	uint16_t rng;
+	uint8_t fctl;
+	uint64_t flash_done_us;
+	int weak_dropped;
+	int weak_healed;
+	uint8_t fwdata[4];
+	int fwcount;
+	sim_dma_t dma[sim_dma_channels];
+	uint8_t xdata[0x10000];
+	uint8_t flash[TARGET_FLASH_MAX_SIZE];
+} usb_sim_t;
+
+static err_t sim_parse(const char *options, sim_config_t *config)
+{
+	err_t err = err_failed;
+	char *copy = NULL;
+	char *save = NULL;
+
+	config->latency_us = 0;
+	config->byte_ns = 0;
+	config->write_ns = 20000;
+	config->erase_us = 20000;
+	config->chip_erase_us = 20000;
+	config->dma_ns = 100;
+	config->devices = 1;
+	config->locked = 0;
+	config->weak_page = -1;
+	config->image = NULL;
+
+	copy = strdup(options ? options : "");
+	if (!copy) {
+		error_out("Can't allocate memory\n");
+	}
+
+	for (char *opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(opt, '=');
+		uint32_t number = 0;
+
+		if (value) {
+			*value++ = '\0';
+			number = strtoul(value, NULL, 0);
+		}
+
+		if (!strcmp(opt, "latency") && value) {
+			config->latency_us = number;
+		}
+		else if (!strcmp(opt, "byte") && value) {
+			config->byte_ns = number;
+		}
+		else if (!strcmp(opt, "write") && value) {
+			config->write_ns = number;
+		}
+		else if (!strcmp(opt, "erase") && value) {
+			config->erase_us = number;
+		}
+		else if (!strcmp(opt, "chip-erase") && value) {
+			config->chip_erase_us = number;
+		}
+		else if (!strcmp(opt, "dma") && value) {
+			config->dma_ns = number;
+		}
+		else if (!strcmp(opt, "devices") && value) {
+			config->devices = number;
+		}
+		else if (!strcmp(opt, "locked") && !value) {
+			config->locked = 1;
+		}
+		else if (!strcmp(opt, "weak") && value) {
+			config->weak_page = number;
+		}
+		else if (!strcmp(opt, "image") && value) {
+			free(config->image);
+			config->image = strdup(value);
+			if (!config->image) {
+				error_out("Can't allocate memory\n");
+			}
+		}
+		else {
+			error_out("Bad simulator option %s\n", opt);
+		}
+	}
+
+	err = err_none;
+
+out:
+	if (err) {
+		free(config->image);
+		config->image = NULL;
+	}
+	free(copy);
+	return err;
+}
+
+int usb_sim_count(const char *options)
+{
+	sim_config_t config;
+
+	if (sim_parse(options, &config)) {
+		return -1;
+	}
+	free(config.image);
+
+	return config.devices;
+}
+
+static err_t sim_output(usb_sim_t *sim, const uint8_t *data, int size)
+{
+	err_t err = err_failed;
+	uint8_t *in;
+
+	if (sim->in_size + size > sim->in_capacity) {
+		int capacity = (sim->in_size + size) * 2;
+
+		in = realloc(sim->in, capacity);
+		if (!in) {
+			error_out("Can't allocate memory\n");
+		}
+		sim->in = in;
+		sim->in_capacity = capacity;
+	}
+
+	memcpy(sim->in + sim->in_size, data, size);
+	sim->in_size += size;
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static uint8_t sim_status(usb_sim_t *sim)
+{
+	uint8_t status = STATUS_OSCILLATOR_STABLE;
+
+	if (sim->debug) {
+		status |= STATUS_CPU_HALTED | STATUS_HALT_STATUS;
+	}
+	if (sim->config.locked) {
+		status |= STATUS_DEBUG_LOCKED;
+	}
+	if (wait_now_us() < sim->chip_erase_us) {
+		status |= STATUS_ERASE_BUSY;
+	}
+
+	return status;
+}
+
+static void sim_flash_update(usb_sim_t *sim)
+{
+	if (sim->fctl & (FLASH_BUSY | FLASH_WRITE | FLASH_ERASE) && wait_now_us() >= sim->flash_done_us) {
+		sim->fctl &= ~(FLASH_BUSY | FLASH_WRITE | FLASH_ERASE);
+	}
+}
+
+static uint8_t sim_dma_armed(usb_sim_t *sim)
+{
+	uint64_t now_us = wait_now_us();
+	uint8_t armed = 0;
+
+	// The arm bit is cleared once the last byte has moved
+	for (int ch = 0; ch < sim_dma_channels; ch++) {
+		sim_dma_t *dma = &sim->dma[ch];
+
+		if (dma->armed && dma->finished && now_us >= dma->done_us) {
+			dma->armed = 0;
+		}
+		if (dma->armed) {
+			armed |= 1 << ch;
+		}
+	}
+
+	return armed;
+}
+
+static uint8_t sim_read(usb_sim_t *sim, uint16_t addr)
+{
+	uint32_t flash_addr;
+
+	if (addr >= XDATA_FLASH) {
+		flash_addr = (sim->xdata[MEMORY_CONTROL] & MEMORY_CONTROL_BANK) * TARGET_FLASH_BANK_SIZE;
+		flash_addr += addr - XDATA_FLASH;
+		return sim->flash[flash_addr];
+	}
+
+	switch (addr) {
+		case FLASH_CONTROL:
+			sim_flash_update(sim);
+			return sim->fctl;
+		case DMA_ARM:
+			return sim_dma_armed(sim);
+		case RNG_DATA_LOW:
+			return sim->rng & 0xff;
+		case RNG_DATA_HIGH:
+			return sim->rng >> 8;
+		default:
+			return sim->xdata[addr];
+	}
+}
+
+static err_t sim_write(usb_sim_t *sim, uint16_t addr, uint8_t val);
+
+static err_t sim_dma_trigger(usb_sim_t *sim, int ch)
+{
+	err_t err = err_none;
+	sim_dma_t *dma = &sim->dma[ch];
+	int moved = 0;
+
+	if (!dma->armed || dma->finished) {
+		goto out;
+	}
+
+	// Block transfers move everything on one trigger, single ones a byte
+	do {
+		err = sim_write(sim, dma->dst, sim_read(sim, dma->src));
+		noerr_or_out(err);
+
+		dma->src += dma->src_inc;
+		dma->dst += dma->dst_inc;
+		dma->count++;
+		moved++;
+	} while (dma->count < dma->len && (dma->tmode & DMA_TMODE_BLOCK));
+
+	if (dma->count == dma->len) {
+		dma->finished = 1;
+		dma->done_us = wait_now_us() + (uint64_t)moved * sim->config.dma_ns / 1000;
+	}
+
+out:
+	return err;
+}
+
+static int sim_dma_increment(uint8_t mode)
+{
+	switch (mode & 0x3) {
+		case 1:
+			return 1;
+		case 2:
+			return 2;
+		case 3:
+			return -1;
+		default:
+			return 0;
+	}
+}
+
+static err_t sim_dma_arm(usb_sim_t *sim, uint8_t channels)
+{
+	err_t err = err_failed;
+
+	// Abort
+	if (channels & 0x80) {
+		for (int ch = 0; ch < sim_dma_channels; ch++) {
+			if (channels & (1 << ch)) {
+				sim->dma[ch].armed = 0;
+			}
+		}
+		err = err_none;
+		goto out;
+	}
+
+	// The descriptor is loaded when the channel is armed
+	for (int ch = 0; ch < sim_dma_channels; ch++) {
+		sim_dma_t *dma = &sim->dma[ch];
+		uint16_t config;
+		const uint8_t *desc;
+
+		if (!(channels & (1 << ch))) {
+			continue;
+		}
+
+		if (ch == 0) {
+			config = sim->xdata[DMA0_ADDR_LOW] | sim->xdata[DMA0_ADDR_HIGH] << 8;
+		}
+		else {
+			config = sim->xdata[DMA14_ADDR_LOW] | sim->xdata[DMA14_ADDR_HIGH] << 8;
+			config += (ch - 1) * 8;
+		}
+		if (config + 8 > sim_sram_size) {
+			error_out("[Sim] DMA%d descriptor at 0x%04x is outside of SRAM\n", ch, config);
+		}
+		desc = sim->xdata + config;
+
+		dma->src = desc[0] << 8 | desc[1];
+		dma->dst = desc[2] << 8 | desc[3];
+		dma->len = (desc[4] & 0x1f) << 8 | desc[5];
+		dma->trigger = desc[6] & 0x1f;
+		dma->tmode = desc[6] & 0x60;
+		dma->src_inc = sim_dma_increment(desc[7] >> 6);
+		dma->dst_inc = sim_dma_increment(desc[7] >> 4);
+		dma->count = 0;
+		dma->finished = 0;
+		dma->armed = 1;
+
+		if (!dma->len) {
+			error_out("[Sim] DMA%d armed with no length\n", ch);
+		}
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_flash_word(usb_sim_t *sim, uint8_t val)
+{
+	err_t err = err_failed;
+	uint32_t word = sim->xdata[FLASH_ADDR_LOW] | sim->xdata[FLASH_ADDR_HIGH] << 8;
+
+	sim->fwdata[sim->fwcount++] = val;
+	if (sim->fwcount < 4) {
+		err = err_none;
+		goto out;
+	}
+	sim->fwcount = 0;
+
+	if (!(sim->fctl & FLASH_WRITE)) {
+		error_out("[Sim] Flash data written outside of a write\n");
+	}
+	if (word * 4 >= TARGET_FLASH_MAX_SIZE) {
+		error_out("[Sim] Flash write beyond 0x%05x\n", TARGET_FLASH_MAX_SIZE);
+	}
+
+	// Programming only clears bits
+	if ((int)(word * 4 / TARGET_FLASH_PAGE_SIZE) == sim->config.weak_page && !sim->weak_healed) {
+		sim->weak_dropped = 1;
+	}
+	else {
+		for (int i = 0; i < 4; i++) {
+			sim->flash[word * 4 + i] &= sim->fwdata[i];
+		}
+	}
+
+	word++;
+	sim->xdata[FLASH_ADDR_LOW] = word & 0xff;
+	sim->xdata[FLASH_ADDR_HIGH] = word >> 8;
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_flash_control(usb_sim_t *sim, uint8_t val)
+{
+	err_t err = err_failed;
+	uint32_t word = sim->xdata[FLASH_ADDR_LOW] | sim->xdata[FLASH_ADDR_HIGH] << 8;
+	sim_dma_t *dma = NULL;
+	int words;
+
+	sim_flash_update(sim);
+
+	if ((val & (FLASH_WRITE | FLASH_ERASE)) && (sim->fctl & FLASH_BUSY)) {
+		error_out("[Sim] Flash controller used while busy\n");
+	}
+
+	sim->fctl = (sim->fctl & (FLASH_BUSY | FLASH_WRITE | FLASH_ERASE)) | (val & FLASH_CACHE);
+
+	if (val & FLASH_ERASE) {
+		int page = word * 4 / TARGET_FLASH_PAGE_SIZE;
+
+		if (page >= TARGET_FLASH_PAGES) {
+			error_out("[Sim] Flash erase beyond 0x%05x\n", TARGET_FLASH_MAX_SIZE);
+		}
+
+		memset(sim->flash + page * TARGET_FLASH_PAGE_SIZE, 0xff, TARGET_FLASH_PAGE_SIZE);
+		if (page == sim->config.weak_page && sim->weak_dropped) {
+			sim->weak_healed = 1;
+		}
+		sim->fctl |= FLASH_BUSY | FLASH_ERASE;
+		sim->flash_done_us = wait_now_us() + sim->config.erase_us;
+	}
+	else if (val & FLASH_WRITE) {
+		for (int ch = 0; ch < sim_dma_channels && !dma; ch++) {
+			if (sim->dma[ch].armed && !sim->dma[ch].finished &&
+			    sim->dma[ch].trigger == DMA_TRIG_FLASH) {
+				dma = &sim->dma[ch];
+			}
+		}
+		if (!dma) {
+			error_out("[Sim] Flash write with no DMA armed\n");
+		}
+
+		// The controller asks for data as long as the channel has some
+		sim->fctl |= FLASH_BUSY | FLASH_WRITE;
+		sim->fwcount = 0;
+		words = (dma->len - dma->count) / 4;
+
+		while (!dma->finished) {
+			err = sim_dma_trigger(sim, dma - sim->dma);
+			noerr_or_out(err);
+		}
+
+		sim->flash_done_us = wait_now_us() + (uint64_t)words * sim->config.write_ns / 1000;
+		dma->done_us = sim->flash_done_us;
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_write(usb_sim_t *sim, uint16_t addr, uint8_t val)
+{
+	err_t err = err_none;
+
+	if (addr >= XDATA_FLASH) {
+		error_out("[Sim] Write to the flash window at 0x%04x\n", addr);
+	}
+
+	switch (addr) {
+		case FLASH_CONTROL:
+			err = sim_flash_control(sim, val);
+			break;
+		case FLASH_WRITE_DATA:
+			err = sim_flash_word(sim, val);
+			break;
+		case DMA_ARM:
+			err = sim_dma_arm(sim, val);
+			break;
+		case DMA_REQ:
+			for (int ch = 0; ch < sim_dma_channels && !err; ch++) {
+				if (val & (1 << ch)) {
+					err = sim_dma_trigger(sim, ch);
+				}
+			}
+			break;
+		case RNG_DATA_LOW:
+			sim->rng = sim->rng << 8 | val;
+			break;
+		case RNG_DATA_HIGH:
+			sim->rng = compute_crc16(&val, 1, sim->rng);
+			break;
+		case MEM_CHIP_ID:
+		case MEM_CHIP_VERSION:
+		case MEM_CHIP_INFO:
+		case MEM_CHIP_INFO + 1:
+			break;
+		default:
+			sim->xdata[addr] = val;
+	}
+
+out:
+	return err;
+}
+
+static err_t sim_burst(usb_sim_t *sim, const uint8_t *data, int size)
+{
+	err_t err = err_failed;
+
+	// Every byte is a DEBUG trigger for the first channel waiting on it
+	for (int i = 0; i < size; i++) {
+		int channel = -1;
+
+		for (int ch = 0; ch < sim_dma_channels && channel < 0; ch++) {
+			if (sim->dma[ch].armed && !sim->dma[ch].finished &&
+			    sim->dma[ch].trigger == DMA_TRIG_DEBUG) {
+				channel = ch;
+			}
+		}
+		if (channel < 0) {
+			error_out("[Sim] Burst byte %d of %d with no DMA armed\n", i, size);
+		}
+
+		sim->xdata[DEBUG_WRITE_DATA] = data[i];
+		err = sim_dma_trigger(sim, channel);
+		noerr_or_out(err);
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_instruction(usb_sim_t *sim, const uint8_t *instr, int size)
+{
+	err_t err = err_failed;
+	int expected;
+
+	switch (instr[0]) {
+		case 0x00: // NOP
+			expected = 1;
+			break;
+		case 0xa3: // INC DPTR
+			sim->dptr++;
+			expected = 1;
+			break;
+		case 0xe0: // MOVX A,@DPTR
+			sim->a = sim_read(sim, sim->dptr);
+			expected = 1;
+			break;
+		case 0xf0: // MOVX @DPTR,A
+			err = sim_write(sim, sim->dptr, sim->a);
+			noerr_or_out(err);
+			expected = 1;
+			break;
+		case 0x74: // MOV A,#data
+			sim->a = instr[1];
+			expected = 2;
+			break;
+		case 0x44: // ORL A,#data
+			sim->a |= instr[1];
+			expected = 2;
+			break;
+		case 0xe5: // MOV A,direct, only the DPTR registers
+			sim->a = instr[1] == 0x82 ? sim->dptr & 0xff : instr[1] == 0x83 ? sim->dptr >> 8 : 0;
+			expected = 2;
+			break;
+		case 0x75: // MOV direct,#data, only DPS
+			expected = 3;
+			break;
+		case 0x90: // MOV DPTR,#data16
+			sim->dptr = instr[1] << 8 | instr[2];
+			expected = 3;
+			break;
+		default:
+			error_out("[Sim] Unsupported instruction 0x%02x\n", instr[0]);
+	}
+
+	if (size != expected) {
+		error_out("[Sim] Instruction 0x%02x takes %d bytes, not %d\n", instr[0], expected, size);
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_debug_command(usb_sim_t *sim, const uint8_t *cmd, int size)
+{
+	err_t err = err_failed;
+	int end = size - sizeof(sim_cmd_footer);
+	uint16_t dptr = sim->dptr;
+	uint8_t a = sim->a;
+	uint8_t collected[TARGET_TXN_MAX_READ * 2];
+	int ncollected = 0;
+
+	if (end < (int)sizeof(sim_cmd_header) ||
+	    memcmp(cmd, sim_cmd_header, sizeof(sim_cmd_header)) ||
+	    memcmp(cmd + end, sim_cmd_footer, sizeof(sim_cmd_footer))) {
+		error_out("[Sim] Malformed debug command\n");
+	}
+
+	/*
+	 * Each instruction is a flag byte, DEBUG_INSTR with the instruction
+	 * size and the instruction. 0x4e sends A back, 0x4f also flushes what
+	 * was collected to the host.
+	 */
+	for (int pos = 0; pos < end;) {
+		uint8_t flag = cmd[pos];
+		int instr_size = cmd[pos + 1] & 0x03;
+
+		if ((cmd[pos + 1] & ~0x03) != (TARGET_DBG_INSTR & ~0x03) || !instr_size ||
+		    pos + 2 + instr_size > end) {
+			error_out("[Sim] Malformed debug instruction at byte %d\n", pos);
+		}
+
+		err = sim_instruction(sim, cmd + pos + 2, instr_size);
+		noerr_or_out(err);
+
+		if (flag == 0x4e || flag == 0x4f) {
+			if (ncollected == sizeof(collected)) {
+				error_out("[Sim] Too many bytes read by one command\n");
+			}
+			collected[ncollected++] = sim->a;
+		}
+		if (flag == 0x4f) {
+			err = sim_output(sim, collected, ncollected);
+			noerr_or_out(err);
+			ncollected = 0;
+		}
+
+		pos += 2 + instr_size;
+	}
+
+	sim->dptr = dptr;
+	sim->a = a;
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_command(usb_sim_t *sim, const uint8_t *cmd, int size)
+{
+	err_t err = err_failed;
+	uint8_t byte;
+
+	if (sim->burst_size) {
+		if (size != sim->burst_size) {
+			error_out("[Sim] Burst of %dB announced, %dB sent\n", sim->burst_size, size);
+		}
+		sim->burst_size = 0;
+
+		err = sim_burst(sim, cmd, size);
+		noerr_or_out(err);
+		goto out;
+	}
+
+	if (!sim->debug) {
+		error_out("[Sim] Debug command outside of debug mode\n");
+	}
+
+	if (size == 2 && cmd[0] == TARGET_RD_HDR && cmd[1] == TARGET_RD_CONFIG) {
+		err = sim_output(sim, &sim->config_reg, 1);
+	}
+	else if (size == 2 && cmd[0] == TARGET_RD_HDR && cmd[1] == TARGET_RD_STATUS) {
+		byte = sim_status(sim);
+		err = sim_output(sim, &byte, 1);
+	}
+	else if (size == 3 && cmd[0] == TARGET_WR_HDR && cmd[1] == TARGET_WR_CONFIG) {
+		sim->config_reg = cmd[2];
+		err = err_none;
+	}
+	else if (size == 2 && cmd[0] == TARGET_ERASE_HDR && cmd[1] == TARGET_CHIP_ERASE) {
+		memset(sim->flash, 0xff, sizeof(sim->flash));
+		sim->chip_erase_us = wait_now_us() + sim->config.chip_erase_us;
+		err = err_none;
+	}
+	else if (size == 3 && cmd[0] == TARGET_BURST_HDR && (cmd[1] & TARGET_BURST_WRITE)) {
+		sim->burst_size = (cmd[1] & ~TARGET_BURST_WRITE) << 8 | cmd[2];
+		err = err_none;
+	}
+	else {
+		err = sim_debug_command(sim, cmd, size);
+	}
+
+out:
+	return err;
+}
+
+static void sim_delay(usb_sim_t *sim, int size)
+{
+	uint64_t now_us = wait_now_us();
+
+	// Transfers go through the debugger one after the other
+	if (sim->due_us < now_us) {
+		sim->due_us = now_us;
+	}
+	sim->due_us += sim->config.latency_us + (uint64_t)size * sim->config.byte_ns / 1000;
+}
+
+static void sim_wait(usb_sim_t *sim)
+{
+	uint64_t now_us = wait_now_us();
+
+	if (sim->due_us > now_us) {
+		usleep(sim->due_us - now_us);
+	}
+}
+
+static err_t sim_control(
+	void *backend, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	usb_sim_t *sim = backend;
+	err_t err = err_failed;
+	uint8_t *bytes = data;
+
+	log_print("[Sim] Control Transfer <%s> %dB req=0x%02x <val=0x%02x, idx=0x%02x>\n",
+		endpoint == USB_IN ? "in" : "out", size, request, value, index);
+
+	sim_delay(sim, size);
+
+	switch (request) {
+		case VENDOR_GET_INFO:
+			if (endpoint != USB_IN || size != sizeof(ccd_fw_info_t)) {
+				error_out("[Sim] Bad GET_INFO request\n");
+			}
+			// chip 0x2541, firmware 0x0001 rev 0x0001
+			memset(bytes, 0, size);
+			bytes[0] = 0x41;
+			bytes[1] = 0x25;
+			bytes[2] = 0x01;
+			bytes[4] = 0x01;
+			break;
+		case VENDOR_STATE:
+			if (endpoint != USB_IN || size != 1) {
+				error_out("[Sim] Bad STATE request\n");
+			}
+			bytes[0] = 0;
+			break;
+		case VENDOR_SET_SPEED:
+			break;
+		case VENDOR_RESET:
+			// Held in debug until the next reset
+			sim->debug = 0;
+			sim->burst_size = 0;
+			sim->in_size = 0;
+			if (index) {
+				memset(sim->dma, 0, sizeof(sim->dma));
+				sim->fctl = 0;
+			}
+			break;
+		case VENDOR_DEBUG:
+			sim->debug = 1;
+			break;
+		default:
+			error_out("[Sim] Unknown vendor request 0x%02x\n", request);
+	}
+
+	sim_wait(sim);
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t sim_submit(
+	void *backend, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	usb_sim_t *sim = backend;
+	err_t err = err_failed;
+
+	log_print("[Sim] Bulk Transfer <%s> %dB\n", endpoint == USB_IN ? "in" : "out", size);
+
+	sim_delay(sim, size);
+
+	if (endpoint == USB_OUT) {
+		err = sim_command(sim, data, size);
+		noerr_or_out(err);
+	}
+	else {
+		// The real debugger would time out
+		if (size > sim->in_size) {
+			error_out("[Sim] %dB read with %dB to send\n", size, sim->in_size);
+		}
+		memcpy(data, sim->in, size);
+		memmove(sim->in, sim->in + size, sim->in_size - size);
+		sim->in_size -= size;
+	}
+
+	err = err_none;
+
+out:
+	if (callback) {
+		callback(user, err);
+	}
+	return err;
+}
+
+static err_t sim_flush(void *backend)
+{
+	sim_wait(backend);
+
+	return err_none;
+}
+
+static void sim_close(void *backend)
+{
+	usb_sim_t *sim = backend;
+
+	if (sim) {
+		free(sim->config.image);
+		free(sim->in);
+		free(sim);
+	}
+}
+
+static const usb_transport_t usb_sim_transport = {
+	.control = sim_control,
+	.submit  = sim_submit,
+	.flush   = sim_flush,
+	.close   = sim_close,
+};
+
+void *usb_sim_open(const char *options, int index, const usb_transport_t **transport)
+{
+	usb_sim_t *sim = NULL;
+	FILE *fp = NULL;
+	int err = 1;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim) {
+		error_out("Can't allocate memory\n");
+	}
+
+	if (sim_parse(options, &sim->config)) {
+		goto out;
+	}
+	if (index >= sim->config.devices) {
+		error_out("Can't find device\n");
+	}
+
+	log_print("[Sim] Simulating device %d\n", index);
+
+	memset(sim->flash, 0xff, sizeof(sim->flash));
+	sim->xdata[MEM_CHIP_ID] = sim_chip_id;
+	sim->xdata[MEM_CHIP_VERSION] = sim_chip_version;
+	sim->xdata[MEM_CHIP_INFO] = sim_chip_info & 0xff;
+	sim->xdata[MEM_CHIP_INFO + 1] = sim_chip_info >> 8;
+
+	if (sim->config.image) {
+		fp = fopen(sim->config.image, "rb");
+		if (!fp) {
+			error_out("Can't open %s\n", sim->config.image);
+		}
+		if (!fread(sim->flash, 1, sizeof(sim->flash), fp) && ferror(fp)) {
+			error_out("Can't read %s\n", sim->config.image);
+		}
+	}
+
+	*transport = &usb_sim_transport;
+	err = 0;
+
+out:
+	if (fp) {
+		fclose(fp);
+	}
+	if (err) {
+		sim_close(sim);
+		sim = NULL;
+	}
+	return sim;
+}
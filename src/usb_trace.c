@@ -0,0 +1,512 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "usb_backend.h"
+#include "wait.h"
+
+/*
+ * Trace file: a header followed by one record per transfer, in submission
+ * order, each followed by its payload (OUT data sent or IN data received).
+ * Fields are in host byte order.
+ */
+#define TRACE_MAGIC "CCDTRACE"
+
+enum {
+	trace_version = 1,
+};
+
+typedef enum {
+	trace_control,
+	trace_bulk,
+} trace_kind_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} trace_header_t;
+
+typedef struct {
+	uint8_t kind;
+	uint8_t endpoint;
+	uint8_t request;
+	uint8_t status;
+	uint16_t value;
+	uint16_t index;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t submit_us; // Since the start of the trace
+	uint64_t done_us;
+} trace_record_t;
+
+typedef struct usb_record_t usb_record_t;
+
+typedef struct {
+	usb_record_t *ctx;
+	trace_record_t record;
+	uint8_t *data; // Copy of OUT data, caller buffer for IN
+	usb_callback_t callback;
+	void *user;
+} record_pending_t;
+
+struct usb_record_t {
+	FILE *file;
+	void *inner;
+	const usb_transport_t *transport;
+	uint64_t origin_us;
+
+	// Bulk transfers are written once completed, IN data is only known then
+	record_pending_t **pending;
+	int npending;
+	int capacity;
+};
+
+typedef struct {
+	uint8_t *map;
+	size_t size;
+	size_t offset;
+	int records;
+	int timing;
+	uint64_t due_us;
+	uint64_t recorded_us;
+	int diverged;
+	err_t error;
+} usb_replay_t;
+
+static err_t record_write(usb_record_t *ctx, const trace_record_t *record, const void *data)
+{
+	err_t err = err_failed;
+
+	if (fwrite(record, sizeof(*record), 1, ctx->file) != 1 ||
+	    (record->size && fwrite(data, record->size, 1, ctx->file) != 1)) {
+		error_out("Can't write trace\n");
+	}
+
+	err = err_none;
+
+out:
+	return err;
+}
+
+static err_t record_control(
+	void *backend, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	usb_record_t *ctx = backend;
+	trace_record_t record = {
+		.kind = trace_control,
+		.endpoint = endpoint,
+		.request = request,
+		.value = value,
+		.index = index,
+		.size = size,
+	};
+	err_t err;
+	err_t ret;
+
+	record.submit_us = wait_now_us() - ctx->origin_us;
+	ret = ctx->transport->control(ctx->inner, endpoint, request, value, index, data, size);
+	record.done_us = wait_now_us() - ctx->origin_us;
+	record.status = ret != err_none;
+
+	err = record_write(ctx, &record, data);
+	noerr_or_out(err);
+
+	err = ret;
+
+out:
+	return err;
+}
+
+static void record_done(void *user, err_t err)
+{
+	record_pending_t *pending = user;
+
+	pending->record.done_us = wait_now_us() - pending->ctx->origin_us;
+	pending->record.status = err != err_none;
+
+	if (pending->callback) {
+		pending->callback(pending->user, err);
+	}
+}
+
+static err_t record_submit(
+	void *backend, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	usb_record_t *ctx = backend;
+	record_pending_t *pending = NULL;
+	record_pending_t **array;
+	err_t err = err_failed;
+
+	if (ctx->npending == ctx->capacity) {
+		array = realloc(ctx->pending, (ctx->capacity * 2 + 16) * sizeof(*array));
+		if (!array) {
+			error_out("Can't allocate memory\n");
+		}
+		ctx->pending = array;
+		ctx->capacity = ctx->capacity * 2 + 16;
+	}
+
+	pending = calloc(1, sizeof(*pending) + (endpoint == USB_OUT ? size : 0));
+	if (!pending) {
+		error_out("Can't allocate memory\n");
+	}
+
+	pending->ctx = ctx;
+	pending->record.kind = trace_bulk;
+	pending->record.endpoint = endpoint;
+	pending->record.size = size;
+	pending->callback = callback;
+	pending->user = user;
+
+	if (endpoint == USB_OUT) {
+		pending->data = (uint8_t *)(pending + 1);
+		memcpy(pending->data, data, size);
+	}
+	else {
+		pending->data = data;
+	}
+
+	pending->record.submit_us = wait_now_us() - ctx->origin_us;
+	err = ctx->transport->submit(ctx->inner, endpoint, data, size, record_done, pending);
+	noerr_or_out(err);
+
+	ctx->pending[ctx->npending++] = pending;
+	pending = NULL;
+
+out:
+	free(pending);
+	return err;
+}
+
+static err_t record_flush(void *backend)
+{
+	usb_record_t *ctx = backend;
+	err_t err;
+	err_t ret;
+
+	ret = ctx->transport->flush(ctx->inner);
+
+	for (int i = 0; i < ctx->npending; i++) {
+		record_pending_t *pending = ctx->pending[i];
+
+		err = record_write(ctx, &pending->record, pending->data);
+		if (err && !ret) {
+			ret = err;
+		}
+		free(pending);
+	}
+	ctx->npending = 0;
+
+	return ret;
+}
+
+static void record_close(void *backend)
+{
+	usb_record_t *ctx = backend;
+
+	if (ctx) {
+		if (ctx->npending) {
+			record_flush(ctx);
+		}
+		if (ctx->transport) {
+			ctx->transport->close(ctx->inner);
+		}
+		if (ctx->file) {
+			fclose(ctx->file);
+		}
+		free(ctx->pending);
+		free(ctx);
+	}
+}
+
+static const usb_transport_t usb_record_transport = {
+	.control = record_control,
+	.submit  = record_submit,
+	.flush   = record_flush,
+	.close   = record_close,
+};
+
+void *usb_record_open(
+	const char *file, void *inner, const usb_transport_t *inner_transport,
+	const usb_transport_t **transport)
+{
+	usb_record_t *ctx = NULL;
+	trace_header_t header = {
+		.magic = TRACE_MAGIC,
+		.version = trace_version,
+	};
+	int err = 1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
+	}
+
+	log_print("[Record] Tracing transfers to %s\n", file);
+
+	ctx->file = fopen(file, "wb");
+	if (!ctx->file) {
+		error_out("Can't open %s\n", file);
+	}
+
+	if (fwrite(&header, sizeof(header), 1, ctx->file) != 1) {
+		error_out("Can't write trace\n");
+	}
+
+	ctx->inner = inner;
+	ctx->transport = inner_transport;
+	ctx->origin_us = wait_now_us();
+
+	*transport = &usb_record_transport;
+	err = 0;
+
+out:
+	if (err && ctx) {
+		// The inner transport stays with the caller
+		ctx->transport = NULL;
+		record_close(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+static err_t replay_next(
+	usb_replay_t *ctx, trace_kind_t kind, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	trace_record_t record;
+	uint8_t *payload;
+	err_t err = err_failed;
+
+	// Past a divergence the trace says nothing about the session anymore
+	if (ctx->diverged) {
+		goto out;
+	}
+
+	if (ctx->size - ctx->offset < sizeof(record)) {
+		error_out("Replay ran past the end of the trace at record %d\n", ctx->records);
+	}
+
+	memcpy(&record, ctx->map + ctx->offset, sizeof(record));
+	payload = ctx->map + ctx->offset + sizeof(record);
+
+	if (ctx->size - ctx->offset - sizeof(record) < record.size) {
+		error_out("Trace is truncated at record %d\n", ctx->records);
+	}
+
+	if (record.kind != kind || record.endpoint != endpoint || (int)record.size != size ||
+	    (kind == trace_control &&
+	     (record.request != request || record.value != value || record.index != index))) {
+		error_out("Replay diverged at record %d: expected %s <%s> %dB, got %s <%s> %dB\n",
+			ctx->records,
+			record.kind == trace_control ? "control" : "bulk",
+			record.endpoint == USB_IN ? "in" : "out", record.size,
+			kind == trace_control ? "control" : "bulk",
+			endpoint == USB_IN ? "in" : "out", size);
+	}
+
+	if (endpoint == USB_OUT) {
+		for (int i = 0; i < size; i++) {
+			if (payload[i] != ((uint8_t *)data)[i]) {
+				error_out("Replay diverged at record %d: OUT data differs at byte %d\n",
+					ctx->records, i);
+			}
+		}
+	}
+	else {
+		memcpy(data, payload, size);
+	}
+
+	log_print("[Replay] Record %d %s <%s> %dB\n",
+		ctx->records, kind == trace_control ? "control" : "bulk",
+		endpoint == USB_IN ? "in" : "out", size);
+
+	/*
+	 * The device serves transfers in order: each one takes the time it was
+	 * busy with it when recorded, starting once submitted and once the
+	 * previous one is done.
+	 */
+	if (ctx->timing) {
+		uint64_t start_us = record.submit_us > ctx->recorded_us ? record.submit_us : ctx->recorded_us;
+		uint64_t now_us = wait_now_us();
+
+		if (ctx->due_us < now_us) {
+			ctx->due_us = now_us;
+		}
+		if (record.done_us > start_us) {
+			ctx->due_us += record.done_us - start_us;
+		}
+		if (record.done_us > ctx->recorded_us) {
+			ctx->recorded_us = record.done_us;
+		}
+	}
+
+	ctx->offset += sizeof(record) + record.size;
+	ctx->records++;
+
+	err = record.status ? err_failed : err_none;
+	return err;
+
+out:
+	ctx->diverged = 1;
+	return err;
+}
+
+static void replay_wait(usb_replay_t *ctx)
+{
+	uint64_t now_us = wait_now_us();
+
+	if (ctx->due_us > now_us) {
+		usleep(ctx->due_us - now_us);
+	}
+}
+
+static err_t replay_control(
+	void *backend, usb_endpoint_t endpoint,
+	int request, int value, int index, void *data, int size)
+{
+	usb_replay_t *ctx = backend;
+	err_t err;
+
+	err = replay_next(ctx, trace_control, endpoint, request, value, index, data, size);
+	replay_wait(ctx);
+
+	return err;
+}
+
+// Completions are reported right away, the delay is carried by the flush
+static err_t replay_submit(
+	void *backend, usb_endpoint_t endpoint, void *data, int size,
+	usb_callback_t callback, void *user)
+{
+	usb_replay_t *ctx = backend;
+	err_t err;
+
+	err = replay_next(ctx, trace_bulk, endpoint, 0, 0, 0, data, size);
+	if (err && !ctx->error) {
+		ctx->error = err;
+	}
+	if (callback) {
+		callback(user, err);
+	}
+
+	return err_none;
+}
+
+static err_t replay_flush(void *backend)
+{
+	usb_replay_t *ctx = backend;
+	err_t err;
+
+	replay_wait(ctx);
+
+	err = ctx->error;
+	ctx->error = err_none;
+
+	return err;
+}
+
+static void replay_close(void *backend)
+{
+	usb_replay_t *ctx = backend;
+
+	if (ctx) {
+		if (ctx->map && ctx->offset < ctx->size) {
+			log_print("[Replay] Trace not fully replayed, stopped after record %d\n", ctx->records);
+		}
+		if (ctx->map) {
+			munmap(ctx->map, ctx->size);
+		}
+		free(ctx);
+	}
+}
+
+static const usb_transport_t usb_replay_transport = {
+	.control = replay_control,
+	.submit  = replay_submit,
+	.flush   = replay_flush,
+	.close   = replay_close,
+};
+
+void *usb_replay_open(const char *file, int timing, const usb_transport_t **transport)
+{
+	usb_replay_t *ctx = NULL;
+	trace_header_t header;
+	struct stat st;
+	void *map;
+	int fd = -1;
+	int err = 1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error_out("Can't allocate memory\n");
+	}
+
+	log_print("[Replay] Serving transfers from %s\n", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		error_out("Can't open %s\n", file);
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+		error_out("%s is not a trace\n", file);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		error_out("Can't map %s\n", file);
+	}
+	ctx->map = map;
+	ctx->size = st.st_size;
+
+	memcpy(&header, ctx->map, sizeof(header));
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.version != trace_version) {
+		error_out("%s is not a trace\n", file);
+	}
+
+	ctx->offset = sizeof(header);
+	ctx->timing = timing;
+
+	*transport = &usb_replay_transport;
+	err = 0;
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (err) {
+		replay_close(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
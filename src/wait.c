@@ -0,0 +1,142 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "stats.h"
+#include "wait.h"
+
+enum {
+	WAIT_MIN_BACKOFF_US = 20,
+	WAIT_MAX_BACKOFF_US = 5000,
+};
+
+// CC2541 datasheet figures
+static const uint32_t wait_default_ns[wait_op_count] = {
+	[wait_flash_write] = 20000,
+	[wait_page_erase]  = 20000000,
+	[wait_chip_erase]  = 20000000,
+	[wait_dma]         = 100,
+};
+
+static const char *wait_names[wait_op_count] = {
+	[wait_flash_write] = "flash_write",
+	[wait_page_erase]  = "page_erase",
+	[wait_chip_erase]  = "chip_erase",
+	[wait_dma]         = "dma",
+};
+
+void wait_model_init(wait_model_t *model)
+{
+	for (int op = 0; op < wait_op_count; op++) {
+		model->unit_ns[op] = wait_default_ns[op];
+	}
+}
+
+uint64_t wait_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void wait_learn(wait_model_t *model, wait_op_t op, int units, uint64_t elapsed_us, int polls)
+{
+	uint64_t unit_ns = model->unit_ns[op];
+
+	if (polls == 1) {
+		// Done before the first poll, the real time is lower than the model
+		unit_ns -= unit_ns / 8;
+	}
+	else {
+		unit_ns = (3 * unit_ns + elapsed_us * 1000 / units) / 4;
+	}
+
+	// A slow usb round trip mustn't throw the model off
+	if (unit_ns < wait_default_ns[op] / 8) {
+		unit_ns = wait_default_ns[op] / 8;
+	}
+	if (unit_ns > (uint64_t)wait_default_ns[op] * 8) {
+		unit_ns = (uint64_t)wait_default_ns[op] * 8;
+	}
+
+	model->unit_ns[op] = unit_ns;
+}
+
+err_t wait_until(wait_model_t *model, wait_op_t op, int units, uint64_t start_us,
+	wait_poll_t poll, void *arg)
+{
+	err_t err = err_failed;
+	uint64_t expected_us = (uint64_t)model->unit_ns[op] * units / 1000;
+	uint64_t elapsed_us = wait_now_us() - start_us;
+	uint64_t backoff_us = expected_us / 16;
+	uint64_t max_backoff_us = expected_us / 4;
+	int polls = 0;
+	int done = 0;
+	uint64_t start_ns = stats_begin();
+	char name[32];
+
+	if (backoff_us < WAIT_MIN_BACKOFF_US) {
+		backoff_us = WAIT_MIN_BACKOFF_US;
+	}
+	if (max_backoff_us < backoff_us) {
+		max_backoff_us = backoff_us;
+	}
+	if (max_backoff_us > WAIT_MAX_BACKOFF_US) {
+		max_backoff_us = WAIT_MAX_BACKOFF_US;
+	}
+
+	if (expected_us > elapsed_us) {
+		usleep(expected_us - elapsed_us);
+	}
+
+	while (1) {
+		err = poll(arg, &done);
+		noerr_or_out(err);
+		polls++;
+
+		if (done) {
+			break;
+		}
+
+		usleep(backoff_us);
+		backoff_us = backoff_us * 2 > max_backoff_us ? max_backoff_us : backoff_us * 2;
+	}
+
+	elapsed_us = wait_now_us() - start_us;
+
+	if (units > 0) {
+		wait_learn(model, op, units, elapsed_us, polls);
+	}
+
+	snprintf(name, sizeof(name), "wait.%s", wait_names[op]);
+	stats_record(name, start_ns, 0);
+
+	log_print("[Wait] %s of %d: %dus, %d poll%s, now %uns per unit\n",
+		wait_names[op], units, (int)elapsed_us, polls, polls > 1 ? "s" : "", model->unit_ns[op]);
+
+out:
+	return err;
+}
@@ -0,0 +1,58 @@
+/**
+ * @section LICENSE
+ * Copyright (c) 2013, Floris Chabert. All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "tools.h"
+
+typedef enum {
+	wait_flash_write, // Per 4-byte word
+	wait_page_erase,  // Per page
+	wait_chip_erase,  // Per erase
+	wait_dma,         // Per byte
+	wait_op_count,
+} wait_op_t;
+
+/**
+ * Expected duration of each operation, in ns per unit.
+ * Starts from the datasheet figures and follows what the part does.
+ */
+typedef struct {
+	uint32_t unit_ns[wait_op_count];
+} wait_model_t;
+
+typedef err_t (*wait_poll_t)(void *arg, int *done);
+
+void wait_model_init(wait_model_t *model);
+uint64_t wait_now_us(void);
+
+/**
+ * Wait for an operation of a number of units started at start_us.
+ * Sleeps until it is expected to be done, then polls with a bounded
+ * backoff. The observed duration updates the model.
+ */
+err_t wait_until(wait_model_t *model, wait_op_t op, int units, uint64_t start_us,
+	wait_poll_t poll, void *arg);
+
+#endif